@@ -1,7 +1,7 @@
 #include "wlc.h"
 // #include "layouts.h"
-void tile();
-void monocle();
+void tile(struct wlc_output *o, uint32_t nc, struct wlr_box *slots);
+void monocle(struct wlc_output *o, uint32_t nc, struct wlr_box *slots);
 
 static struct wlc_layout layouts[] = {
     { tile, "t" },
@@ -9,6 +9,31 @@ static struct wlc_layout layouts[] = {
     { NULL, "f" },
 };
 
+// Output scales by output name. Outputs not listed use scale 1. Outputs
+// without modes, like headless ones, can be given a custom mode. For example
+//     { "eDP-1", 1.5, 0, 0, 0 },
+static const struct wlc_output_rule output_rules[] = {
+    { "HEADLESS-1", 1, 1280, 720, 60000 },
+};
+
+// Outputs that mirror another output instead of showing clients of their own.
+// For example, to show the laptop panel on a projector
+//     { "HDMI-A-1", "eDP-1" },
+static const struct wlc_mirror_rule mirror_rules[] = {
+};
+
 #define MODKEY WLR_MODIFIER_ALT
 
+// Spawned with MODKEY+Return
+static const char *termcmd[] = { "foot", NULL };
+
 uint32_t follow_mouse = 0;
+// Server side borders in layout pixels. Layout slots include the border
+uint32_t border_width = 2;
+static const float border_focus[4] = { 0.33, 0.53, 0.73, 1.0 };
+static const float border_normal[4] = { 0.27, 0.27, 0.27, 1.0 };
+// Use the highest refresh rate at the native resolution instead of the
+// output's preferred mode
+uint32_t prefer_refresh = 0;
+// Seconds without input before outputs are powered down, 0 to keep them on
+uint32_t idle_timeout = 0;
@@ -0,0 +1,192 @@
+/******************************************************************************
+ * File:             dump.c
+ *
+ * Description:      Frame dump mode for rendering regression and perf tests
+ *****************************************************************************/
+
+/* NOTE
+ * Composited frames are read back on the compositor thread and handed to a
+ * worker thread which encodes them as binary PPM files named
+ * <output>-<frame>.ppm. The worker also appends one line per dumped frame to
+ * <dir>/frames.csv:
+ *
+ * output,frame,render_ns,damage_px,rendered_px
+ *
+ * render_ns covers output_frame_notify up to the readback, so neither the
+ * readback nor the encoding are part of it. damage_px leaves out the
+ * performance overlay, like its DMG line.
+ */
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wlc.h"
+
+#define DUMP_QUEUE_MAX 8
+
+struct dump_job {
+    struct dump_job *next;
+    char name[64];
+    uint64_t frame;
+    uint64_t render_ns;
+    uint64_t damage;
+    uint64_t rendered;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    bool y_invert;
+    uint8_t *data;
+};
+
+static const char *dump_dir;
+static uint32_t dump_every;
+static FILE *sidecar;
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct dump_job *head;
+static struct dump_job *tail;
+static uint32_t queued;
+static bool stopping;
+
+static void write_ppm(struct dump_job *job) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-%06lu.ppm", dump_dir, job->name, job->frame);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        ERROR("Could not open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    // XRGB8888 is little endian B, G, R, X in memory
+    fprintf(f, "P6\n%u %u\n255\n", job->width, job->height);
+    uint8_t *row = malloc(job->width * 3);
+    for (uint32_t y = 0; y < job->height; ++y) {
+        uint32_t sy = job->y_invert ? job->height - 1 - y : y;
+        uint8_t *src = job->data + sy * job->stride;
+        for (uint32_t x = 0; x < job->width; ++x) {
+            row[x * 3] = src[x * 4 + 2];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4];
+        }
+        fwrite(row, 3, job->width, f);
+    }
+    free(row);
+    fclose(f);
+}
+
+static void *dump_worker(void *data) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!head && !stopping) pthread_cond_wait(&cond, &lock);
+        struct dump_job *job = head;
+        if (!job) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        head = job->next;
+        if (!head) tail = NULL;
+        --queued;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
+        write_ppm(job);
+        fprintf(sidecar, "%s,%lu,%lu,%lu,%lu\n",
+                job->name, job->frame, job->render_ns, job->damage, job->rendered);
+        free(job->data);
+        free(job);
+    }
+}
+
+// Enables frame dumping of every nth frame into dir
+bool dump_init(const char *dir, uint32_t every) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/frames.csv", dir);
+    sidecar = fopen(path, "w");
+    if (!sidecar) {
+        ERROR("Could not open %s: %s", path, strerror(errno));
+        return false;
+    }
+    fprintf(sidecar, "output,frame,render_ns,damage_px,rendered_px\n");
+
+    dump_dir = dir;
+    dump_every = every ? every : 1;
+    if (pthread_create(&worker, NULL, dump_worker, NULL)) {
+        ERROR("Could not start frame dump thread");
+        fclose(sidecar);
+        sidecar = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool dump_enabled() {
+    return sidecar != NULL;
+}
+
+// Returns the number of pixels in region
+uint64_t region_area(pixman_region32_t *region) {
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &nrects);
+    uint64_t area = 0;
+    for (int i = 0; i < nrects; ++i) {
+        area += (uint64_t) (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+    }
+    return area;
+}
+
+// Reads back the frame rendered on output o and queues it for the worker. Must
+// be called while the renderer is still bound to the output
+void dump_frame(struct wlc_output *o, struct wlr_renderer *r, uint64_t render_ns) {
+    if (!sidecar || o->frames % dump_every) return;
+
+    struct wlr_output *wo = o->wlr_output;
+    struct dump_job *job = calloc(1, sizeof(struct dump_job));
+    job->width = wo->width;
+    job->height = wo->height;
+    job->stride = wo->width * 4;
+    job->data = malloc(job->stride * job->height);
+
+    uint32_t flags = 0;
+    if (!job->data || !wlr_renderer_read_pixels(r, DRM_FORMAT_XRGB8888, &flags,
+                job->stride, job->width, job->height, 0, 0, 0, 0, job->data)) {
+        ERROR("Could not read back frame %lu of %s", o->frames, wo->name);
+        free(job->data);
+        free(job);
+        return;
+    }
+    job->y_invert = flags & WLR_RENDERER_READ_PIXELS_Y_INVERT;
+    snprintf(job->name, sizeof(job->name), "%s", wo->name);
+    job->frame = o->frames;
+    job->render_ns = render_ns;
+    job->damage = o->damage_px;
+    job->rendered = o->rendered_px;
+
+    // Wait instead of dropping frames when the worker falls behind, the
+    // recorded timings were taken before this point
+    pthread_mutex_lock(&lock);
+    while (queued >= DUMP_QUEUE_MAX) pthread_cond_wait(&cond, &lock);
+    if (tail) tail->next = job;
+    else head = job;
+    tail = job;
+    ++queued;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// Writes out the queued frames and stops the worker
+void dump_finish() {
+    if (!sidecar) return;
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(worker, NULL);
+
+    fclose(sidecar);
+    sidecar = NULL;
+}
@@ -0,0 +1,194 @@
+/******************************************************************************
+ * File:             hud.c
+ *
+ * Description:      On-screen performance overlay
+ *****************************************************************************/
+
+/* NOTE
+ * The overlay sits in the top left corner of each output and shows
+ *
+ * FPS   frames per second over the last HUD_SAMPLES frames
+ * FT    render time of the last frame, with a graph of the recent ones
+ * CL    clients composited in the last frame
+ * DMG   damaged pixels of the last frame, without the overlay itself
+ * ARR   duration of the last arrange
+ *
+ * Text is drawn from a built-in 5x7 bitmap font. Each glyph is uploaded once
+ * as a texture and reused every frame. Values are shortened to fit the box,
+ * which is all the overlay damages.
+ */
+#include <drm_fourcc.h>
+#include <stdio.h>
+#include <wlr/render/wlr_texture.h>
+#include <wlr/types/wlr_matrix.h>
+
+#include "wlc.h"
+
+#define GLYPH_W 5
+#define GLYPH_H 7
+#define HUD_SCALE 2
+#define HUD_PAD 4
+#define HUD_LINES 5
+#define HUD_GRAPH_H 32
+#define HUD_WIDTH (HUD_SAMPLES * 2 + HUD_PAD * 2)
+#define HUD_HEIGHT (HUD_LINES * (GLYPH_H + 2) * HUD_SCALE + HUD_GRAPH_H + HUD_PAD * 3)
+// Characters that fit on a line of the overlay box
+#define HUD_CHARS ((HUD_WIDTH - HUD_PAD) / ((GLYPH_W + 1) * HUD_SCALE))
+
+// Rows of each glyph, most significant of the low 5 bits is the left column
+static const struct {
+    char c;
+    uint8_t rows[GLYPH_H];
+} font[] = {
+    { '0', { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e } },
+    { '1', { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e } },
+    { '2', { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f } },
+    { '3', { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e } },
+    { '4', { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 } },
+    { '5', { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e } },
+    { '6', { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e } },
+    { '7', { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+    { '8', { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e } },
+    { '9', { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c } },
+    { '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c } },
+    { 'A', { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 } },
+    { 'C', { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e } },
+    { 'D', { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c } },
+    { 'F', { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 } },
+    { 'G', { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f } },
+    { 'L', { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f } },
+    { 'M', { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 } },
+    { 'P', { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 } },
+    { 'R', { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 } },
+    { 'S', { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e } },
+    { 'T', { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 } },
+};
+
+static struct wlr_texture *glyphs[128];
+bool hud_enabled;
+
+// Returns the cached texture of glyph c, uploading it on first use
+static struct wlr_texture *glyph(struct wlr_renderer *r, char c) {
+    if (c < 0 || glyphs[(int) c]) return c < 0 ? NULL : glyphs[(int) c];
+
+    for (size_t i = 0; i < sizeof(font) / sizeof(font[0]); ++i) {
+        if (font[i].c != c) continue;
+
+        uint32_t pixels[GLYPH_W * GLYPH_H];
+        for (int y = 0; y < GLYPH_H; ++y) {
+            for (int x = 0; x < GLYPH_W; ++x) {
+                bool set = font[i].rows[y] & (1 << (GLYPH_W - 1 - x));
+                pixels[y * GLYPH_W + x] = set ? 0xffffffff : 0;
+            }
+        }
+        glyphs[(int) c] = wlr_texture_from_pixels(r, DRM_FORMAT_ARGB8888,
+                GLYPH_W * 4, GLYPH_W, GLYPH_H, pixels);
+        return glyphs[(int) c];
+    }
+    return NULL;
+}
+
+// Draws at most HUD_CHARS characters of text, anything drawn past the box
+// would be outside the overlay's damage
+static void draw_text(struct wlr_renderer *r, struct wlr_output *o,
+        int x, int y, const char *text) {
+    for (int n = 0; *text && n < HUD_CHARS; ++text, ++n, x += (GLYPH_W + 1) * HUD_SCALE) {
+        struct wlr_texture *t = glyph(r, *text);
+        if (!t) continue;
+
+        struct wlr_box box = { x, y, GLYPH_W * HUD_SCALE, GLYPH_H * HUD_SCALE };
+        float matrix[9];
+        wlr_matrix_project_box(matrix, &box, WL_OUTPUT_TRANSFORM_NORMAL, 0,
+                o->transform_matrix);
+        wlr_render_texture_with_matrix(r, t, matrix, 1);
+    }
+}
+
+// Box covered by the overlay, in output buffer coordinates
+void hud_box(struct wlr_box *box) {
+    box->x = 0;
+    box->y = 0;
+    box->width = HUD_WIDTH;
+    box->height = HUD_HEIGHT;
+}
+
+// Formats a duration in ms behind label, with as many decimals as fit on a
+// line
+static void format_ms(char *line, size_t size, const char *label, uint64_t ns, int decimals) {
+    for (; decimals >= 0; --decimals) {
+        int n = snprintf(line, size, "%s %.*fMS", label, decimals, ns / 1e6);
+        if (n <= HUD_CHARS) return;
+    }
+}
+
+// Formats a pixel count behind label, in millions once it no longer fits
+static void format_px(char *line, size_t size, const char *label, uint64_t px) {
+    int n = snprintf(line, size, "%s %lu", label, px);
+    if (n <= HUD_CHARS) return;
+    n = snprintf(line, size, "%s %.1fM", label, px / 1e6);
+    if (n <= HUD_CHARS) return;
+    snprintf(line, size, "%s %luM", label, px / 1000000);
+}
+
+// Records the render time of the frame being drawn on o
+void hud_record(struct wlc_output *o, uint64_t render_ns) {
+    o->hud_sample = (o->hud_sample + 1) % HUD_SAMPLES;
+    o->hud_render_ns[o->hud_sample] = render_ns;
+    o->hud_frame_ns[o->hud_sample] = o->last_frame.tv_sec * 1000000000ull
+        + o->last_frame.tv_nsec;
+}
+
+// Draws the overlay for output o. The caller damages the overlay box every
+// frame while the overlay is shown so the values stay live
+void hud_render(struct wlc_output *o, struct wlr_renderer *r) {
+    struct wlr_output *wo = o->wlr_output;
+    wlr_renderer_scissor(r, NULL);
+
+    struct wlr_box box;
+    hud_box(&box);
+    float bg[4] = { 0, 0, 0, 0.7 };
+    wlr_render_rect(r, &box, bg, wo->transform_matrix);
+
+    // FPS over the frames in the history
+    uint32_t oldest = (o->hud_sample + 1) % HUD_SAMPLES;
+    uint64_t span = o->hud_frame_ns[o->hud_sample] - o->hud_frame_ns[oldest];
+    double_t fps = o->hud_frame_ns[oldest] && span ?
+        (HUD_SAMPLES - 1) * 1e9 / span : 0;
+
+    char line[32];
+    int x = HUD_PAD;
+    int y = HUD_PAD;
+    int step = (GLYPH_H + 2) * HUD_SCALE;
+    snprintf(line, sizeof(line), "FPS %.1f", fps);
+    draw_text(r, wo, x, y, line);
+    format_ms(line, sizeof(line), "FT", o->hud_render_ns[o->hud_sample], 2);
+    draw_text(r, wo, x, y += step, line);
+    snprintf(line, sizeof(line), "CL %u", o->composited);
+    draw_text(r, wo, x, y += step, line);
+    format_px(line, sizeof(line), "DMG", o->damage_px);
+    draw_text(r, wo, x, y += step, line);
+    format_ms(line, sizeof(line), "ARR", o->arrange_ns, 3);
+    draw_text(r, wo, x, y += step, line);
+
+    // Render time graph, oldest sample on the left. Full height is one 60Hz
+    // frame
+    float fg[4] = { 0.2, 0.8, 0.2, 1 };
+    float over[4] = { 0.9, 0.2, 0.2, 1 };
+    int base = y + step + HUD_PAD + HUD_GRAPH_H;
+    for (int i = 0; i < HUD_SAMPLES; ++i) {
+        uint64_t ns = o->hud_render_ns[(oldest + i) % HUD_SAMPLES];
+        int h = ns * HUD_GRAPH_H / 16666667;
+        bool late = h > HUD_GRAPH_H;
+        if (late) h = HUD_GRAPH_H;
+        if (h == 0) continue;
+        struct wlr_box bar = { HUD_PAD + i * 2, base - h, 2, h };
+        wlr_render_rect(r, &bar, late ? over : fg, wo->transform_matrix);
+    }
+}
+
+void hud_finish() {
+    for (int i = 0; i < 128; ++i) {
+        if (glyphs[i]) wlr_texture_destroy(glyphs[i]);
+        glyphs[i] = NULL;
+    }
+}
@@ -0,0 +1,194 @@
+/******************************************************************************
+ * File:             idle.c
+ *
+ * Description:      Idle notification, idle inhibition and output power-down
+ *****************************************************************************/
+
+/* NOTE
+ * Input only records when it happened. One timer checks at the end of the
+ * timeout whether there was input since and, if there was, re-arms itself for
+ * the rest of the timeout, so the input path never reprograms a timer.
+ *
+ * Once the timeout passes without input every enabled output is disabled. A
+ * disabled output gets no frame events and wlc draws nothing on it until the
+ * next input enables it again with a full repaint.
+ *
+ * Clients such as swayidle learn about idleness through org_kde_kwin_idle.
+ * zwp_idle_inhibit_manager_v1 inhibitors only count while their surface
+ * belongs to a client shown on an output, so a video player on a hidden tag
+ * no longer keeps the outputs on. While any inhibitor counts, outputs stay on
+ * and idle clients are not notified.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <wlr/types/wlr_idle.h>
+#include <wlr/types/wlr_idle_inhibit_v1.h>
+
+#include "wlc.h"
+
+struct wlc_inhibitor {
+    struct wl_listener destroy;
+};
+
+static struct wlr_idle *idle;
+static struct wlr_idle_inhibit_manager_v1 *inhibit_manager;
+static struct wl_listener new_inhibitor;
+static struct wlr_seat *idle_seat;
+static struct wl_event_loop *loop;
+static struct wl_event_source *timer;
+static struct wl_event_source *update_source;
+static uint32_t timeout_ms; // 0 never powers down
+static uint64_t last_input_ms;
+static bool inhibited;
+static bool powered_down;
+
+static uint64_t now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000ull + t.tv_nsec / 1000000;
+}
+
+static void power_off(struct wlc_output *o) {
+    if (!o->wlr_output->enabled) return;
+    wlr_output_enable(o->wlr_output, false);
+    if (!wlr_output_commit(o->wlr_output)) {
+        ERROR("Could not power down %s", o->wlr_output->name);
+        wlr_output_rollback(o->wlr_output);
+        return;
+    }
+    o->powered_off = true;
+}
+
+static void power_on(struct wlc_output *o) {
+    if (!o->powered_off) return;
+    o->powered_off = false;
+    wlr_output_enable(o->wlr_output, true);
+    if (!wlr_output_commit(o->wlr_output)) {
+        ERROR("Could not power up %s", o->wlr_output->name);
+        wlr_output_rollback(o->wlr_output);
+        return;
+    }
+    if (o->mirror_of) {
+        o->mirror_dirty = true;
+        wlr_output_schedule_frame(o->wlr_output);
+    } else {
+        wlr_output_damage_add_whole(o->wlr_damage);
+    }
+}
+
+static int idle_timeout(void *data) {
+    uint64_t idle_ms = now_ms() - last_input_ms;
+    if (inhibited || idle_ms < timeout_ms) {
+        wl_event_source_timer_update(timer, inhibited ? timeout_ms : timeout_ms - idle_ms);
+        return 0;
+    }
+
+    // Stays unarmed until the next input
+    powered_down = true;
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        power_off(o);
+    }
+    wl_list_for_each(o, &mirrors, link) {
+        power_off(o);
+    }
+    INFO("Idle for %u ms, outputs powered down", timeout_ms);
+    return 0;
+}
+
+// Called for every input event. Outputs powered down come back right away
+void idle_activity() {
+    last_input_ms = now_ms();
+    if (idle) wlr_idle_notify_activity(idle, idle_seat);
+    if (!powered_down) return;
+
+    powered_down = false;
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        power_on(o);
+    }
+    wl_list_for_each(o, &mirrors, link) {
+        power_on(o);
+    }
+    if (timer) wl_event_source_timer_update(timer, timeout_ms);
+    INFO("Input, outputs powered up");
+}
+
+static void update_inhibited(void *data) {
+    update_source = NULL;
+    bool now = false;
+    struct wlr_idle_inhibitor_v1 *inhibitor;
+    wl_list_for_each(inhibitor, &inhibit_manager->inhibitors, link) {
+        if (surface_shown(inhibitor->surface)) {
+            now = true;
+            break;
+        }
+    }
+    if (now == inhibited) return;
+
+    inhibited = now;
+    wlr_idle_set_enabled(idle, idle_seat, !inhibited);
+    // Idle time counts from the end of the inhibition
+    if (!inhibited) last_input_ms = now_ms();
+}
+
+// Schedules a check of the inhibitors at the end of the current dispatch. Call
+// whenever a client may have been shown or hidden
+void idle_schedule() {
+    if (update_source || !inhibit_manager) return;
+    update_source = wl_event_loop_add_idle(loop, update_inhibited, NULL);
+}
+
+// Inhibitors are still listed while they are destroyed, so only schedule
+static void inhibitor_destroy(struct wl_listener *listener, void *data) {
+    struct wlc_inhibitor *i = wl_container_of(listener, i, destroy);
+    wl_list_remove(&i->destroy.link);
+    free(i);
+    idle_schedule();
+}
+
+static void new_inhibitor_notify(struct wl_listener *listener, void *data) {
+    struct wlr_idle_inhibitor_v1 *inhibitor = data;
+    struct wlc_inhibitor *i = calloc(1, sizeof(struct wlc_inhibitor));
+    if (!i) return;
+    i->destroy.notify = inhibitor_destroy;
+    wl_signal_add(&inhibitor->events.destroy, &i->destroy);
+    idle_schedule();
+}
+
+// Sets up the idle protocols for seat. Outputs power down after timeout ms
+// without input, never if timeout is 0
+bool idle_init(struct wl_display *display, struct wlr_seat *seat, uint32_t timeout) {
+    loop = wl_display_get_event_loop(display);
+    idle_seat = seat;
+    timeout_ms = timeout;
+    last_input_ms = now_ms();
+    if (timeout_ms) {
+        timer = wl_event_loop_add_timer(loop, idle_timeout, NULL);
+        if (timer) wl_event_source_timer_update(timer, timeout_ms);
+    }
+
+    // Power-down works without the protocols
+    idle = wlr_idle_create(display);
+    inhibit_manager = wlr_idle_inhibit_v1_create(display);
+    if (!idle || !inhibit_manager) {
+        idle = NULL;
+        inhibit_manager = NULL;
+        return false;
+    }
+    new_inhibitor.notify = new_inhibitor_notify;
+    wl_signal_add(&inhibit_manager->events.new_inhibitor, &new_inhibitor);
+    return true;
+}
+
+// Inhibitors and outputs destroyed with the display must not schedule
+// anything after this
+void idle_finish() {
+    if (timer) wl_event_source_remove(timer);
+    if (update_source) wl_event_source_remove(update_source);
+    timer = NULL;
+    update_source = NULL;
+    if (inhibit_manager) wl_list_remove(&new_inhibitor.link);
+    inhibit_manager = NULL;
+    idle = NULL;
+}
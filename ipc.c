@@ -0,0 +1,515 @@
+/******************************************************************************
+ * File:             ipc.c
+ *
+ * Description:      Unix domain control socket for wlc
+ *****************************************************************************/
+
+/* PROTOCOL
+ * A request is a single line of commands separated by ';'. Every command of a
+ * request is validated before any of them is applied, then the request is
+ * applied as a whole followed by one deferred arrange of each output it
+ * touched. The reply is the output of any queries followed by a line with "ok"
+ * or "error <reason>".
+ *
+ * tag <client> <mask>      Set the tags of a client
+ * view <mask>              Show the tags on the focused output
+ * toggle <mask>            Toggle the tags on the focused output
+ * layout <symbol>          Select the layout of the focused output
+ * nmaster <n>              Set the number of master clients
+ * fmaster <f>              Set the fraction of the output used by the masters
+ * focus <client>           Focus a client
+ * clients                  id tag output x y width height title
+ * outputs                  name tag layout x y width height
+ * load                     id commits dropped frames damage_px buffer_width
+ *                          buffer_height title
+ * stats                    name layout_cache_hits layout_cache_misses arranges
+ *                          coalesced_arranges rendered_px frames mirror_frames
+ * output_add <w> <h>       Add a headless output, replies with its name
+ * output_remove <name>     Remove a headless output
+ * quit                     Exit once the reply is sent
+ *
+ * Queries only read client and output state and never damage an output. The
+ * output commands only work on the headless backend and are meant for testing
+ * hotplug, see stress.c.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <wlr/backend/headless.h>
+
+#include "wlc.h"
+
+#define IPC_BUF 8192
+#define IPC_MAX_CMDS 256
+
+enum ipc_op {
+    IPC_TAG,
+    IPC_VIEW,
+    IPC_TOGGLE,
+    IPC_LAYOUT,
+    IPC_NMASTER,
+    IPC_FMASTER,
+    IPC_FOCUS,
+    IPC_CLIENTS,
+    IPC_OUTPUTS,
+    IPC_STATS,
+    IPC_LOAD,
+    IPC_OUTPUT_ADD,
+    IPC_OUTPUT_REMOVE,
+    IPC_QUIT,
+};
+
+struct ipc_cmd {
+    enum ipc_op op;
+    struct wlc_client *c;
+    uint32_t u;
+    uint32_t v;
+    double_t f;
+    const char *name; // Points into the request line
+};
+
+struct ipc_conn {
+    int fd;
+    struct wl_event_source *source;
+    struct wl_list link;
+    char in[IPC_BUF];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    bool eof; // Peer is done sending, close once the reply is out
+};
+
+static int ipc_fd = -1;
+static char ipc_path[108];
+static struct wl_event_source *ipc_source;
+static struct wl_event_loop *ipc_loop;
+static struct wl_list conns;
+
+static void conn_close(struct ipc_conn *conn) {
+    wl_event_source_remove(conn->source);
+    close(conn->fd);
+    wl_list_remove(&conn->link);
+    free(conn->out);
+    free(conn);
+}
+
+// Queue formatted reply text on the connection
+static void conn_printf(struct ipc_conn *conn, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0) return;
+
+    if (conn->outlen + len + 1 > conn->outcap) {
+        size_t cap = conn->outcap ? conn->outcap : 1024;
+        while (cap < conn->outlen + len + 1) cap *= 2;
+        char *out = realloc(conn->out, cap);
+        if (!out) return;
+        conn->out = out;
+        conn->outcap = cap;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(conn->out + conn->outlen, len + 1, fmt, args);
+    va_end(args);
+    conn->outlen += len;
+}
+
+// Write as much of the queued reply as the socket takes. Returns false if the
+// connection broke
+static bool conn_flush(struct ipc_conn *conn) {
+    size_t done = 0;
+    while (done < conn->outlen) {
+        ssize_t n = send(conn->fd, conn->out + done, conn->outlen - done, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        done += n;
+    }
+    memmove(conn->out, conn->out + done, conn->outlen - done);
+    conn->outlen -= done;
+
+    uint32_t mask = conn->eof ? 0 : WL_EVENT_READABLE;
+    if (conn->outlen) mask |= WL_EVENT_WRITABLE;
+    wl_event_source_fd_update(conn->source, mask);
+    return true;
+}
+
+static struct wlc_client *client_by_id(const char *s) {
+    if (!s) return NULL;
+    uint32_t id = strtoul(s, NULL, 10);
+    struct wlc_client *c;
+    wl_list_for_each(c, &lstack, llink) {
+        if (c->id == id) return c;
+    }
+    return NULL;
+}
+
+// Headless output called name, NULL if there is none
+static struct wlc_output *headless_output(const char *name) {
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        if (!strcmp(o->wlr_output->name, name)) break;
+    }
+    if (&o->link == &outputs) {
+        wl_list_for_each(o, &mirrors, link) {
+            if (!strcmp(o->wlr_output->name, name)) break;
+        }
+        if (&o->link == &mirrors) return NULL;
+    }
+    return wlr_output_is_headless(o->wlr_output) ? o : NULL;
+}
+
+static bool parse_uint(const char *s, uint32_t *u) {
+    if (!s) return false;
+    char *end;
+    unsigned long v = strtoul(s, &end, 0);
+    if (*end || end == s) return false;
+    *u = v;
+    return true;
+}
+
+// Parse one command. Returns an error message or NULL on success
+static const char *parse_cmd(char *str, struct ipc_cmd *cmd) {
+    char *save;
+    char *name = strtok_r(str, " \t", &save);
+    char *a1 = strtok_r(NULL, " \t", &save);
+    char *a2 = strtok_r(NULL, " \t", &save);
+    if (!name) return "empty command";
+
+    if (!strcmp(name, "tag")) {
+        cmd->op = IPC_TAG;
+        if (!(cmd->c = client_by_id(a1))) return "no such client";
+        if (!parse_uint(a2, &cmd->u) || !cmd->u || cmd->u > UINT8_MAX) return "bad tag mask";
+    } else if (!strcmp(name, "view") || !strcmp(name, "toggle")) {
+        cmd->op = name[0] == 'v' ? IPC_VIEW : IPC_TOGGLE;
+        if (!parse_uint(a1, &cmd->u) || !cmd->u || cmd->u > UINT16_MAX) return "bad tag mask";
+    } else if (!strcmp(name, "layout")) {
+        cmd->op = IPC_LAYOUT;
+        struct wlc_layout *l;
+        for (cmd->u = 0; (l = get_layout(cmd->u)); ++cmd->u) {
+            if (a1 && !strcmp(l->s, a1)) break;
+        }
+        if (!l) return "no such layout";
+    } else if (!strcmp(name, "nmaster")) {
+        cmd->op = IPC_NMASTER;
+        if (!parse_uint(a1, &cmd->u) || !cmd->u) return "bad master count";
+    } else if (!strcmp(name, "fmaster")) {
+        cmd->op = IPC_FMASTER;
+        cmd->f = a1 ? strtod(a1, NULL) : 0;
+        if (cmd->f <= 0 || cmd->f >= 1) return "bad master fraction";
+    } else if (!strcmp(name, "focus")) {
+        cmd->op = IPC_FOCUS;
+        if (!(cmd->c = client_by_id(a1))) return "no such client";
+    } else if (!strcmp(name, "clients")) {
+        cmd->op = IPC_CLIENTS;
+    } else if (!strcmp(name, "outputs")) {
+        cmd->op = IPC_OUTPUTS;
+    } else if (!strcmp(name, "stats")) {
+        cmd->op = IPC_STATS;
+    } else if (!strcmp(name, "load")) {
+        cmd->op = IPC_LOAD;
+    } else if (!strcmp(name, "output_add")) {
+        cmd->op = IPC_OUTPUT_ADD;
+        if (!headless_backend()) return "no headless backend";
+        if (!parse_uint(a1, &cmd->u) || !parse_uint(a2, &cmd->v)
+                || !cmd->u || !cmd->v || cmd->u > 16384 || cmd->v > 16384) {
+            return "bad output size";
+        }
+    } else if (!strcmp(name, "output_remove")) {
+        cmd->op = IPC_OUTPUT_REMOVE;
+        if (!a1 || !headless_output(a1)) return "no such headless output";
+        cmd->name = a1;
+    } else if (!strcmp(name, "quit")) {
+        cmd->op = IPC_QUIT;
+    } else {
+        return "unknown command";
+    }
+    return NULL;
+}
+
+static void stats_line(struct ipc_conn *conn, struct wlc_output *o) {
+    conn_printf(conn, "%s %lu %lu %lu %lu %lu %lu %lu\n",
+            o->wlr_output->name, o->cache_hits, o->cache_misses,
+            o->arranges, o->arrange_requests - o->arranges,
+            o->rendered_px, o->frames, o->mirror_frames);
+}
+
+static void query(struct ipc_conn *conn, enum ipc_op op) {
+    struct wlc_client *c;
+    struct wlc_output *o;
+    switch (op) {
+    case IPC_CLIENTS:
+        wl_list_for_each(c, &lstack, llink) {
+            const char *title = client_title(c);
+            conn_printf(conn, "%u %u %s %d %d %d %d %s\n",
+                    c->id, c->tag,
+                    c->output ? c->output->wlr_output->name : "-",
+                    c->geom.x, c->geom.y, c->geom.width, c->geom.height,
+                    title ? title : "");
+        }
+        break;
+    case IPC_OUTPUTS:
+        wl_list_for_each(o, &outputs, link) {
+            conn_printf(conn, "%s %u %s %d %d %d %d\n",
+                    o->wlr_output->name, o->tag, get_layout(o->layout)->s,
+                    o->geom->x, o->geom->y, o->geom->width, o->geom->height);
+        }
+        break;
+    case IPC_STATS:
+        wl_list_for_each(o, &outputs, link) {
+            stats_line(conn, o);
+        }
+        wl_list_for_each(o, &mirrors, link) {
+            stats_line(conn, o);
+        }
+        break;
+    case IPC_LOAD:
+        wl_list_for_each(c, &lstack, llink) {
+            const char *title = client_title(c);
+            conn_printf(conn, "%u %lu %lu %lu %lu %d %d %s\n",
+                    c->id, c->stats.commits, c->stats.dropped, c->stats.frames,
+                    c->stats.damage_px, c->stats.buffer_width, c->stats.buffer_height,
+                    title ? title : "");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Apply every command of a request, then arrange and repaint each output that
+// changed exactly once
+static void apply(struct ipc_conn *conn, struct ipc_cmd *cmds, int n) {
+    for (int i = 0; i < n; ++i) {
+        struct ipc_cmd *cmd = &cmds[i];
+        // An output_remove earlier in the request may have taken the focused
+        // output away
+        if (cmd->op < IPC_CLIENTS && !foutput) continue;
+
+        struct wlc_output *o;
+        struct wlr_output *wo;
+        switch (cmd->op) {
+        case IPC_TAG:
+            cmd->c->tag = cmd->u;
+            if (cmd->c->output) cmd->c->output->dirty = true;
+            break;
+        case IPC_VIEW:
+            foutput->tag = cmd->u;
+            foutput->dirty = true;
+            break;
+        case IPC_TOGGLE:
+            foutput->tag ^= cmd->u;
+            foutput->dirty = true;
+            break;
+        case IPC_LAYOUT:
+            foutput->layout = cmd->u;
+            foutput->dirty = true;
+            break;
+        case IPC_NMASTER:
+            foutput->n_master = cmd->u;
+            foutput->dirty = true;
+            break;
+        case IPC_FMASTER:
+            foutput->f_master = cmd->f;
+            foutput->dirty = true;
+            break;
+        case IPC_FOCUS:
+            if (cmd->c->output) {
+                focus_client(cmd->c, client_surface(cmd->c));
+            }
+            break;
+        case IPC_OUTPUT_ADD:
+            // new_output_notify runs before this returns
+            wo = wlr_headless_add_output(headless_backend(), cmd->u, cmd->v);
+            conn_printf(conn, "%s\n", wo ? wo->name : "-");
+            break;
+        case IPC_OUTPUT_REMOVE:
+            // Looked up again, the same name may be removed twice
+            if ((o = headless_output(cmd->name))) wlr_output_destroy(o->wlr_output);
+            break;
+        case IPC_QUIT:
+            quit();
+            break;
+        default:
+            break;
+        }
+    }
+
+    bool changed = false;
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        if (!o->dirty) continue;
+        o->dirty = false;
+        changed = true;
+        schedule_arrange(o);
+        wlr_output_damage_add_whole(o->wlr_damage);
+    }
+
+    if (changed) {
+        update_all_client_outputs();
+        invalidate_plans();
+        toplevel_schedule();
+        idle_schedule();
+    }
+
+    // Keep keyboard focus on a visible client. focus_client is a no-op when the
+    // focused client is still on top
+    if (changed) {
+        struct wlc_client *c = fstack_top();
+        focus_client(c, c ? client_surface(c) : NULL);
+    }
+
+    // Queries see the state after the commands of the request
+    for (int i = 0; i < n; ++i) query(conn, cmds[i].op);
+}
+
+static void handle_request(struct ipc_conn *conn, char *line) {
+    struct ipc_cmd cmds[IPC_MAX_CMDS];
+    int n = 0;
+    char *save;
+    for (char *s = strtok_r(line, ";", &save); s; s = strtok_r(NULL, ";", &save)) {
+        if (strspn(s, " \t") == strlen(s)) continue;
+        if (n == IPC_MAX_CMDS) {
+            conn_printf(conn, "error too many commands\n");
+            return;
+        }
+        const char *err = parse_cmd(s, &cmds[n]);
+        if (err) {
+            conn_printf(conn, "error %s\n", err);
+            return;
+        }
+        if (cmds[n].op < IPC_CLIENTS && !foutput) {
+            conn_printf(conn, "error no output\n");
+            return;
+        }
+        ++n;
+    }
+    apply(conn, cmds, n);
+    conn_printf(conn, "ok\n");
+}
+
+// Requests still in the socket are handled and their replies sent before a
+// connection is closed, so a client may half-close right after its request
+static int conn_event(int fd, uint32_t mask, void *data) {
+    struct ipc_conn *conn = data;
+    if (mask & WL_EVENT_ERROR) {
+        conn_close(conn);
+        return 0;
+    }
+
+    if (!conn->eof && (mask & (WL_EVENT_READABLE | WL_EVENT_HANGUP))) {
+        for (;;) {
+            ssize_t n = recv(fd, conn->in + conn->inlen, IPC_BUF - 1 - conn->inlen, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) {
+                // A last request without a newline ends with the stream
+                if (n == 0 && conn->inlen) {
+                    conn->in[conn->inlen] = '\0';
+                    handle_request(conn, conn->in);
+                    conn->inlen = 0;
+                }
+                conn->eof = true;
+                break;
+            }
+            conn->inlen += n;
+            conn->in[conn->inlen] = '\0';
+
+            // Handle every complete line received so far
+            char *start = conn->in;
+            char *nl;
+            while ((nl = strchr(start, '\n'))) {
+                *nl = '\0';
+                handle_request(conn, start);
+                start = nl + 1;
+            }
+            conn->inlen -= start - conn->in;
+            memmove(conn->in, start, conn->inlen);
+            if (conn->inlen == IPC_BUF - 1) {
+                conn_printf(conn, "error request too long\n");
+                conn->inlen = 0;
+            }
+        }
+    }
+
+    // A hung up peer takes no more output
+    if (!conn_flush(conn) || (mask & WL_EVENT_HANGUP)
+            || (conn->eof && !conn->outlen)) {
+        conn_close(conn);
+    }
+    return 0;
+}
+
+static int ipc_accept(int fd, uint32_t mask, void *data) {
+    int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) {
+        ERROR("IPC accept failed: %s", strerror(errno));
+        return 0;
+    }
+
+    struct ipc_conn *conn = calloc(1, sizeof(struct ipc_conn));
+    if (!conn) {
+        close(cfd);
+        return 0;
+    }
+    conn->fd = cfd;
+    conn->source = wl_event_loop_add_fd(ipc_loop, cfd, WL_EVENT_READABLE, conn_event, conn);
+    wl_list_insert(&conns, &conn->link);
+    return 0;
+}
+
+// Creates the control socket at path and serves it from the event loop
+bool ipc_init(struct wl_event_loop *loop, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERROR("IPC socket path too long: %s", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ipc_fd < 0) {
+        ERROR("Could not create IPC socket: %s", strerror(errno));
+        return false;
+    }
+
+    unlink(path);
+    if (bind(ipc_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(ipc_fd, 16) < 0) {
+        ERROR("Could not bind IPC socket %s: %s", path, strerror(errno));
+        close(ipc_fd);
+        ipc_fd = -1;
+        return false;
+    }
+
+    strcpy(ipc_path, path);
+    wl_list_init(&conns);
+    ipc_loop = loop;
+    ipc_source = wl_event_loop_add_fd(loop, ipc_fd, WL_EVENT_READABLE, ipc_accept, NULL);
+    INFO("IPC socket listening on %s", path);
+    return true;
+}
+
+void ipc_finish() {
+    if (ipc_fd < 0) return;
+
+    struct ipc_conn *conn, *tmp;
+    wl_list_for_each_safe(conn, tmp, &conns, link) {
+        conn_close(conn);
+    }
+    wl_event_source_remove(ipc_source);
+    close(ipc_fd);
+    unlink(ipc_path);
+    ipc_fd = -1;
+}
@@ -0,0 +1,207 @@
+/******************************************************************************
+ * File:             launcher.c
+ *
+ * Description:      Pre-forked helper that spawns programs for wlc
+ *****************************************************************************/
+
+/* NOTE
+ * The helper is forked at the very start of main, while wlc is still small,
+ * so the compositor never forks once its address space has grown. It talks to
+ * wlc over a SOCK_SEQPACKET socket pair, one request or reply per packet:
+ *
+ * request: struct launch_msg followed by NUL separated strings
+ *   LAUNCH_ENV   one "NAME=value" string, set in the helper's environment
+ *   LAUNCH_EXEC  argv of the program to spawn
+ * reply:   struct launch_reply for every LAUNCH_EXEC
+ *
+ * The helper spawns with posix_spawnp, which returns once the child has
+ * exec'd, and replies with the time from the request to that point.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlc.h"
+
+#define LAUNCH_MAX 4096
+#define LAUNCH_ARGS 64
+
+extern char **environ;
+
+enum launch_type {
+    LAUNCH_ENV,
+    LAUNCH_EXEC,
+};
+
+struct launch_msg {
+    uint32_t type;
+    uint32_t len;
+    uint64_t sent_ns; // CLOCK_MONOTONIC when wlc sent the request
+};
+
+struct launch_reply {
+    int32_t pid;
+    int32_t err;
+    uint64_t latency_ns;
+};
+
+static int launch_fd = -1;
+static pid_t helper_pid;
+static struct wl_event_source *launch_source;
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Main loop of the helper process. Never returns
+static void helper_run(int fd) {
+    // Children are reaped automatically, but get default signal handling back
+    signal(SIGCHLD, SIG_IGN);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGCHLD);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSID);
+
+    char buf[sizeof(struct launch_msg) + LAUNCH_MAX + 1];
+    for (;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) _exit(0); // wlc is gone
+        if ((size_t) n < sizeof(struct launch_msg)) continue;
+
+        struct launch_msg *msg = (struct launch_msg *) buf;
+        char *payload = buf + sizeof(struct launch_msg);
+        payload[n - sizeof(struct launch_msg)] = '\0';
+
+        if (msg->type == LAUNCH_ENV) {
+            putenv(strdup(payload));
+            continue;
+        }
+
+        char *argv[LAUNCH_ARGS + 1];
+        int argc = 0;
+        for (char *p = payload; p < buf + n && argc < LAUNCH_ARGS; p += strlen(p) + 1) {
+            argv[argc++] = p;
+        }
+        argv[argc] = NULL;
+
+        struct launch_reply reply = { 0 };
+        pid_t pid;
+        reply.err = argc ? posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ) : EINVAL;
+        reply.pid = reply.err ? -1 : pid;
+        reply.latency_ns = now_ns() - msg->sent_ns;
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+// Forks the helper. Call as early as possible, before wlc allocates anything
+// sizeable
+bool launcher_init() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        ERROR("Could not create launcher socket: %s", strerror(errno));
+        return false;
+    }
+
+    helper_pid = fork();
+    if (helper_pid < 0) {
+        ERROR("Could not fork launcher: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (helper_pid == 0) {
+        close(fds[0]);
+        helper_run(fds[1]);
+    }
+
+    close(fds[1]);
+    launch_fd = fds[0];
+    return true;
+}
+
+static bool launcher_send(uint32_t type, const char *payload, size_t len) {
+    if (launch_fd < 0 || len > LAUNCH_MAX) return false;
+
+    char buf[sizeof(struct launch_msg) + LAUNCH_MAX];
+    struct launch_msg msg = { .type = type, .len = len, .sent_ns = now_ns() };
+    memcpy(buf, &msg, sizeof(msg));
+    memcpy(buf + sizeof(msg), payload, len);
+    return send(launch_fd, buf, sizeof(msg) + len, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0;
+}
+
+// Sets an environment variable for every program spawned from now on
+void launcher_setenv(const char *name, const char *value) {
+    char buf[LAUNCH_MAX];
+    int len = snprintf(buf, sizeof(buf), "%s=%s", name, value);
+    if (len < 0 || len >= LAUNCH_MAX) return;
+    launcher_send(LAUNCH_ENV, buf, len + 1);
+}
+
+// Spawns argv through the helper. Does not block, the result is logged when
+// the helper replies
+void spawn(const char **argv) {
+    char buf[LAUNCH_MAX];
+    size_t len = 0;
+    for (; *argv; ++argv) {
+        size_t n = strlen(*argv) + 1;
+        if (len + n > LAUNCH_MAX) {
+            ERROR("Command line too long to spawn");
+            return;
+        }
+        memcpy(buf + len, *argv, n);
+        len += n;
+    }
+    if (!launcher_send(LAUNCH_EXEC, buf, len)) {
+        ERROR("Could not send spawn request: %s", strerror(errno));
+    }
+}
+
+static int launcher_reply(int fd, uint32_t mask, void *data) {
+    if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) {
+        ERROR("Launcher exited, spawning is no longer possible");
+        wl_event_source_remove(launch_source);
+        launch_source = NULL;
+        close(launch_fd);
+        launch_fd = -1;
+        return 0;
+    }
+
+    struct launch_reply reply;
+    while (recv(fd, &reply, sizeof(reply), MSG_DONTWAIT) == sizeof(reply)) {
+        if (reply.err) {
+            ERROR("Spawn failed: %s", strerror(reply.err));
+            continue;
+        }
+        INFO("Spawned pid %d, %.3f ms from request to exec",
+                reply.pid,
+                reply.latency_ns / 1e6);
+    }
+    return 0;
+}
+
+// Starts handling helper replies on the event loop
+void launcher_attach(struct wl_event_loop *loop) {
+    if (launch_fd < 0) return;
+    launch_source = wl_event_loop_add_fd(loop, launch_fd, WL_EVENT_READABLE, launcher_reply, NULL);
+}
+
+void launcher_finish() {
+    if (launch_source) wl_event_source_remove(launch_source);
+    launch_source = NULL;
+    if (launch_fd >= 0) close(launch_fd); // Helper exits on hangup
+    launch_fd = -1;
+}
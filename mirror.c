@@ -0,0 +1,101 @@
+/******************************************************************************
+ * File:             mirror.c
+ *
+ * Description:      Output mirroring for wlc
+ *****************************************************************************/
+
+/* NOTE
+ * A mirror output never composites clients. When its source output commits a
+ * new frame, the mirror is marked dirty and a frame is scheduled on it. On
+ * that frame the source's front buffer is exported as a dmabuf, imported as a
+ * texture and drawn with a single scaled copy, letterboxed to keep the aspect
+ * ratio. Mirrors are not part of the output layout, so the cursor and clients
+ * can never end up on them.
+ *
+ * The export only contains the primary plane, so a hardware cursor on the
+ * source is not visible on the mirror.
+ */
+#include <string.h>
+#include <time.h>
+#include <wlr/backend.h>
+#include <wlr/render/dmabuf.h>
+#include <wlr/render/wlr_texture.h>
+#include <wlr/types/wlr_matrix.h>
+
+#include "wlc.h"
+
+struct wl_list mirrors;
+
+static struct wlc_output *mirror_source(struct wlc_output *m) {
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        if (!strcmp(o->wlr_output->name, m->mirror_of)) return o;
+    }
+    return NULL;
+}
+
+// Called after output src committed a frame with new damage
+void mirror_damage(struct wlc_output *src) {
+    struct wlc_output *m;
+    wl_list_for_each(m, &mirrors, link) {
+        if (strcmp(m->mirror_of, src->wlr_output->name)) continue;
+        m->mirror_dirty = true;
+        wlr_output_schedule_frame(m->wlr_output);
+    }
+}
+
+// Frame handler of mirror outputs, in place of output_frame_notify
+void mirror_frame_notify(struct wl_listener *listener, void *data) {
+    struct wlc_output *m = wl_container_of(listener, m, frame);
+    clock_gettime(CLOCK_MONOTONIC, &m->last_frame);
+
+    struct wlc_output *src = mirror_source(m);
+    if (!m->mirror_dirty || !src || m->powered_off) return;
+
+    struct wlr_dmabuf_attributes attribs;
+    if (!wlr_output_export_dmabuf(src->wlr_output, &attribs)) {
+        ERROR("Could not export %s for mirroring", src->wlr_output->name);
+        return;
+    }
+
+    struct wlr_renderer *r = wlr_backend_get_renderer(m->wlr_output->backend);
+    struct wlr_texture *t = wlr_texture_from_dmabuf(r, &attribs);
+    if (!t || !wlr_output_attach_render(m->wlr_output, NULL)) {
+        ERROR("Could not mirror %s on %s", src->wlr_output->name, m->wlr_output->name);
+        if (t) wlr_texture_destroy(t);
+        wlr_dmabuf_attributes_finish(&attribs);
+        return;
+    }
+
+    // Fit the source into the mirror's buffer, bars where the aspect differs
+    int mw, mh;
+    wlr_output_transformed_resolution(m->wlr_output, &mw, &mh);
+    double_t sx = (double_t) mw / t->width;
+    double_t sy = (double_t) mh / t->height;
+    double_t s = sx < sy ? sx : sy;
+    struct wlr_box box = {
+        .width = t->width * s,
+        .height = t->height * s,
+    };
+    box.x = (mw - box.width) / 2;
+    box.y = (mh - box.height) / 2;
+
+    float matrix[9];
+    wlr_matrix_project_box(matrix, &box, WL_OUTPUT_TRANSFORM_NORMAL, 0,
+            m->wlr_output->transform_matrix);
+
+    wlr_renderer_begin(r, m->wlr_output->width, m->wlr_output->height);
+    float black[4] = { 0, 0, 0, 1 };
+    wlr_renderer_clear(r, black);
+    wlr_render_texture_with_matrix(r, t, matrix, 1);
+    wlr_renderer_end(r);
+
+    if (wlr_output_commit(m->wlr_output)) {
+        m->mirror_dirty = false;
+        ++m->mirror_frames;
+        ++m->frames;
+    }
+
+    wlr_texture_destroy(t);
+    wlr_dmabuf_attributes_finish(&attribs);
+}
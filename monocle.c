@@ -1,12 +1,9 @@
 #include "wlc.h"
-void monocle(){
-    struct wlc_client *c;
-    wl_list_for_each(c, &lstack, llink) {
-        if (!visible(c, foutput)) continue;
-            
-        move(c, 0, 0);
-        resize(c, foutput->geom->width, foutput->geom->height);
+void monocle(struct wlc_output *o, uint32_t nc, struct wlr_box *slots) {
+    for (uint32_t n = 0; n < nc; ++n) {
+        slots[n].x = 0;
+        slots[n].y = 0;
+        slots[n].width = o->geom->width;
+        slots[n].height = o->geom->height;
     }
-    c = fstack_top();
 }
-
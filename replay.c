@@ -0,0 +1,356 @@
+/******************************************************************************
+ * File:             replay.c
+ *
+ * Description:      Input event recording and replay for input path benchmarks
+ *****************************************************************************/
+
+/* NOTE
+ * Recording appends every input event that reaches wlc's keyboard and cursor
+ * listeners to a file. The file is a header followed by fixed size records:
+ *
+ * header   magic "WLCI", version
+ * record   delta_us  time since the previous record
+ *          type      enum wlc_input_type
+ *          state     key and button state, axis orientation | source << 1
+ *          code      keycode, button, axis discrete steps
+ *          x, y      motion delta, absolute position from 0 to 1, axis delta
+ *
+ * Replay only works on the headless backend. It adds a virtual keyboard and
+ * pointer and feeds them the recorded events, at the recorded pace divided by
+ * the speed, or as fast as the event loop runs with speed 0. Events go through
+ * the same path as real ones, from wlr_keyboard and wlr_cursor through the
+ * listeners in wlc.c. Handling time is measured around each injected event,
+ * which covers everything the event triggers synchronously. Once all events
+ * are replayed the count, throughput and p50/p99/max handling time of each
+ * event type are logged and wlc exits, so runs can be scripted. A recording
+ * usually ends with the binding that quits wlc, which stops the replay just
+ * before its end. The report is then logged while wlc shuts down.
+ *
+ * Unaccelerated motion is not recorded, relative pointer clients get the
+ * accelerated delta for both on replay.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wlr/backend/headless.h>
+#include <wlr/interfaces/wlr_keyboard.h>
+#include <wlr/types/wlr_input_device.h>
+#include <wlr/types/wlr_pointer.h>
+
+#include "wlc.h"
+
+#define INPUT_MAGIC 0x49434c57 // "WLCI"
+#define INPUT_VERSION 1
+// Events injected per event loop iteration when replaying at speed 0
+#define REPLAY_BATCH 256
+
+struct input_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct input_record {
+    uint32_t delta_us;
+    uint8_t type;
+    uint8_t state;
+    int32_t code;
+    float x;
+    float y;
+} __attribute__((packed));
+
+static const char *type_names[WLC_INPUT_TYPES] = {
+    "key", "motion", "motion_absolute", "button", "axis", "frame",
+};
+
+static FILE *record_file;
+static uint64_t record_last_ns;
+
+static struct input_record *records;
+static size_t nrecords;
+static size_t next; // Next record to inject
+static uint64_t next_at_us; // Time of the next record from the start of the recording
+static double_t speed;
+static uint64_t replay_start_ns;
+static struct wl_event_source *replay_timer;
+static bool replaying; // Started and not reported yet
+static struct wlr_input_device *keyboard;
+static struct wlr_input_device *pointer;
+static uint64_t *handle_ns[WLC_INPUT_TYPES]; // Handling time of each replayed event
+static size_t handled[WLC_INPUT_TYPES];
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Starts recording input events to path
+bool record_init(const char *path) {
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        ERROR("Could not open %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct input_header header = { INPUT_MAGIC, INPUT_VERSION };
+    fwrite(&header, sizeof(header), 1, record_file);
+    record_last_ns = now_ns();
+    return true;
+}
+
+// Records one input event. event is the wlroots event of the type, unused for
+// frames. Does nothing unless recording
+void record_event(enum wlc_input_type type, const void *event) {
+    if (!record_file) return;
+
+    uint64_t now = now_ns();
+    struct input_record r = {
+        .delta_us = (now - record_last_ns) / 1000,
+        .type = type,
+    };
+    // Keep the remainder so the deltas do not drift over long recordings
+    record_last_ns = now - (now - record_last_ns) % 1000;
+
+    switch (type) {
+    case WLC_INPUT_KEY: {
+        const struct wlr_event_keyboard_key *e = event;
+        r.code = e->keycode;
+        r.state = e->state;
+        break;
+    }
+    case WLC_INPUT_MOTION: {
+        const struct wlr_event_pointer_motion *e = event;
+        r.x = e->delta_x;
+        r.y = e->delta_y;
+        break;
+    }
+    case WLC_INPUT_MOTION_ABSOLUTE: {
+        const struct wlr_event_pointer_motion_absolute *e = event;
+        r.x = e->x;
+        r.y = e->y;
+        break;
+    }
+    case WLC_INPUT_BUTTON: {
+        const struct wlr_event_pointer_button *e = event;
+        r.code = e->button;
+        r.state = e->state;
+        break;
+    }
+    case WLC_INPUT_AXIS: {
+        const struct wlr_event_pointer_axis *e = event;
+        r.state = e->orientation | e->source << 1;
+        r.code = e->delta_discrete;
+        r.x = e->delta;
+        break;
+    }
+    default:
+        break;
+    }
+    fwrite(&r, sizeof(r), 1, record_file);
+}
+
+// Loads a recording to replay at speed once the compositor runs
+bool replay_init(const char *path, double_t s) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        ERROR("Could not open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    struct input_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+            || header.magic != INPUT_MAGIC || header.version != INPUT_VERSION) {
+        ERROR("%s is not an input recording", path);
+        fclose(f);
+        return false;
+    }
+
+    size_t cap = 0;
+    for (;;) {
+        if (nrecords == cap) {
+            cap = cap ? cap * 2 : 4096;
+            struct input_record *r = realloc(records, cap * sizeof(struct input_record));
+            if (!r) {
+                ERROR("Could not allocate input records");
+                fclose(f);
+                return false;
+            }
+            records = r;
+        }
+        if (fread(&records[nrecords], sizeof(struct input_record), 1, f) != 1) break;
+        if (records[nrecords].type >= WLC_INPUT_TYPES) continue;
+        ++nrecords;
+    }
+    fclose(f);
+
+    for (int i = 0; i < WLC_INPUT_TYPES; ++i) {
+        handle_ns[i] = calloc(nrecords ? nrecords : 1, sizeof(uint64_t));
+    }
+    speed = s;
+    INFO("Loaded %zu input events from %s", nrecords, path);
+    return true;
+}
+
+// Feeds one record to the virtual devices
+static void inject(struct input_record *r) {
+    uint32_t msec = now_ns() / 1000000;
+    switch (r->type) {
+    case WLC_INPUT_KEY: {
+        struct wlr_event_keyboard_key e = {
+            .time_msec = msec,
+            .keycode = r->code,
+            .update_state = true,
+            .state = r->state,
+        };
+        wlr_keyboard_notify_key(keyboard->keyboard, &e);
+        break;
+    }
+    case WLC_INPUT_MOTION: {
+        struct wlr_event_pointer_motion e = {
+            .device = pointer,
+            .time_msec = msec,
+            .delta_x = r->x,
+            .delta_y = r->y,
+            .unaccel_dx = r->x,
+            .unaccel_dy = r->y,
+        };
+        wl_signal_emit(&pointer->pointer->events.motion, &e);
+        break;
+    }
+    case WLC_INPUT_MOTION_ABSOLUTE: {
+        struct wlr_event_pointer_motion_absolute e = {
+            .device = pointer,
+            .time_msec = msec,
+            .x = r->x,
+            .y = r->y,
+        };
+        wl_signal_emit(&pointer->pointer->events.motion_absolute, &e);
+        break;
+    }
+    case WLC_INPUT_BUTTON: {
+        struct wlr_event_pointer_button e = {
+            .device = pointer,
+            .time_msec = msec,
+            .button = r->code,
+            .state = r->state,
+        };
+        wl_signal_emit(&pointer->pointer->events.button, &e);
+        break;
+    }
+    case WLC_INPUT_AXIS: {
+        struct wlr_event_pointer_axis e = {
+            .device = pointer,
+            .time_msec = msec,
+            .source = r->state >> 1,
+            .orientation = r->state & 1,
+            .delta = r->x,
+            .delta_discrete = r->code,
+        };
+        wl_signal_emit(&pointer->pointer->events.axis, &e);
+        break;
+    }
+    case WLC_INPUT_FRAME:
+        wl_signal_emit(&pointer->pointer->events.frame, pointer->pointer);
+        break;
+    default:
+        break;
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void replay_report() {
+    replaying = false;
+    INFO("Replayed %zu of %zu input events in %.1f ms at speed %.2f",
+            next, nrecords, (now_ns() - replay_start_ns) / 1e6, speed);
+    for (int i = 0; i < WLC_INPUT_TYPES; ++i) {
+        size_t n = handled[i];
+        if (!n) continue;
+        uint64_t *ns = handle_ns[i];
+        uint64_t total = 0;
+        for (size_t j = 0; j < n; ++j) total += ns[j];
+        qsort(ns, n, sizeof(uint64_t), cmp_u64);
+        INFO("%-15s %8zu events %10.0f/s handled, p50 %.1f us, p99 %.1f us, max %.1f us",
+                type_names[i], n, total ? n * 1e9 / total : 0,
+                ns[n / 2] / 1e3, ns[(size_t) (0.99 * (n - 1))] / 1e3, ns[n - 1] / 1e3);
+    }
+}
+
+static int replay_tick(void *data) {
+    uint64_t now = now_ns();
+    uint64_t due = 0;
+    uint32_t batch = 0;
+    while (next < nrecords) {
+        if (speed > 0) {
+            due = replay_start_ns + next_at_us * 1000 / speed;
+            if (due > now) break;
+        } else if (batch == REPLAY_BATCH) {
+            break;
+        }
+
+        struct input_record *r = &records[next];
+        uint64_t start = now_ns();
+        inject(r);
+        handle_ns[r->type][handled[r->type]++] = now_ns() - start;
+
+        ++batch;
+        if (++next < nrecords) next_at_us += records[next].delta_us;
+    }
+
+    if (next == nrecords) {
+        replay_report();
+        quit();
+        return 0;
+    }
+
+    // Timers only have millisecond resolution. Late events are caught up on
+    // the next tick
+    uint64_t wait_ms = speed > 0 && due > now ? (due - now + 999999) / 1000000 : 1;
+    wl_event_source_timer_update(replay_timer, wait_ms);
+    return 0;
+}
+
+// Adds the virtual devices and starts injecting. Call once the backend runs
+void replay_start(struct wl_event_loop *loop) {
+    if (!records) return;
+
+    struct wlr_backend *headless = headless_backend();
+    if (!headless) {
+        ERROR("Input replay needs the headless backend");
+        return;
+    }
+    // new_input_notify sets both up like real devices
+    keyboard = wlr_headless_add_input_device(headless, WLR_INPUT_DEVICE_KEYBOARD);
+    pointer = wlr_headless_add_input_device(headless, WLR_INPUT_DEVICE_POINTER);
+    if (!keyboard || !pointer) {
+        ERROR("Could not add virtual input devices");
+        return;
+    }
+
+    next = 0;
+    next_at_us = nrecords ? records[0].delta_us : 0;
+    replay_start_ns = now_ns();
+    replay_timer = wl_event_loop_add_timer(loop, replay_tick, NULL);
+    if (replay_timer) wl_event_source_timer_update(replay_timer, 1);
+    replaying = replay_timer != NULL;
+}
+
+void replay_finish() {
+    // wlc quit before the last event, usually from the replayed quit binding
+    if (replaying) replay_report();
+    if (record_file) fclose(record_file);
+    record_file = NULL;
+    if (replay_timer) wl_event_source_remove(replay_timer);
+    replay_timer = NULL;
+    free(records);
+    records = NULL;
+    for (int i = 0; i < WLC_INPUT_TYPES; ++i) {
+        free(handle_ns[i]);
+        handle_ns[i] = NULL;
+    }
+}
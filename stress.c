@@ -0,0 +1,440 @@
+/******************************************************************************
+ * File:             stress.c
+ *
+ * Description:      Soak and churn test client for wlc
+ *****************************************************************************/
+
+/* NOTE
+ * A Wayland client that hammers the lifecycle paths of a headless wlc. It is
+ * meant to be started by wlc itself with -x, so it finds WAYLAND_DISPLAY and
+ * WLC_SOCK in its environment. Every round runs
+ *
+ * map            opens a toplevel and waits until its first buffer is in
+ * unmap          destroys the oldest toplevel once -w of them are alive
+ * tag            retags a random client over IPC
+ * view           shows random tags on the focused output over IPC
+ * output_add     hot-adds a headless output over IPC
+ * output_remove  removes it again
+ *
+ * and then samples the resident set of wlc, found through the credentials of
+ * the IPC socket. Latency is measured from the request until wlc has handled
+ * it, so a map includes the roundtrip that commits the first buffer. At the
+ * end the throughput and tail latency of each operation and the RSS growth
+ * over the rounds are printed, and with -q wlc is told to exit, which is when
+ * a sanitizer build reports leaks.
+ *
+ * -r n   rounds, 10
+ * -n n   maps per round, 200
+ * -w n   toplevels alive at once, 16
+ * -t n   tag and view requests per round, 500
+ * -o n   outputs added and removed per round, 4
+ * -q     make wlc exit at the end
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "xdg-shell-client-protocol.h"
+
+#define BUF_SIZE 64
+#define IPC_BUF 65536
+
+enum op {
+    OP_MAP,
+    OP_UNMAP,
+    OP_TAG,
+    OP_VIEW,
+    OP_OUTPUT_ADD,
+    OP_OUTPUT_REMOVE,
+    OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+    "map", "unmap", "tag", "view", "output_add", "output_remove",
+};
+
+// Latency samples of one operation, in ns
+struct samples {
+    uint64_t *ns;
+    size_t len;
+    size_t cap;
+    uint64_t total;
+};
+
+struct window {
+    struct wl_surface *surface;
+    struct xdg_surface *xdg_surface;
+    struct xdg_toplevel *toplevel;
+    bool configured;
+};
+
+static struct wl_display *display;
+static struct wl_compositor *compositor;
+static struct wl_shm *shm;
+static struct xdg_wm_base *wm_base;
+static struct wl_buffer *buffer;
+static int ipc_fd = -1;
+static pid_t wlc_pid;
+static struct samples samples[OP_COUNT];
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void record(enum op op, uint64_t start) {
+    struct samples *s = &samples[op];
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->ns = realloc(s->ns, s->cap * sizeof(uint64_t));
+        if (!s->ns) abort();
+    }
+    uint64_t ns = now_ns() - start;
+    s->ns[s->len++] = ns;
+    s->total += ns;
+}
+
+// Resident set size of process pid in KiB
+static long rss_kib(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long size, resident = -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void wm_base_ping(void *data, struct xdg_wm_base *base, uint32_t serial) {
+    xdg_wm_base_pong(base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+    .ping = wm_base_ping,
+};
+
+static void registry_global(void *data, struct wl_registry *registry,
+        uint32_t name, const char *interface, uint32_t version) {
+    if (!strcmp(interface, wl_compositor_interface.name)) {
+        compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+    } else if (!strcmp(interface, wl_shm_interface.name)) {
+        shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    } else if (!strcmp(interface, xdg_wm_base_interface.name)) {
+        wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+        xdg_wm_base_add_listener(wm_base, &wm_base_listener, NULL);
+    }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+// One small buffer shared by every window. Windows never draw again, so it is
+// never written after this
+static struct wl_buffer *create_buffer() {
+    int stride = BUF_SIZE * 4;
+    int size = stride * BUF_SIZE;
+    int fd = memfd_create("wlc-stress", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) < 0) return NULL;
+
+    uint32_t *pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pixels == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    for (int i = 0; i < BUF_SIZE * BUF_SIZE; ++i) pixels[i] = 0xff336699;
+    munmap(pixels, size);
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+    struct wl_buffer *b = wl_shm_pool_create_buffer(pool, 0,
+            BUF_SIZE, BUF_SIZE, stride, WL_SHM_FORMAT_ARGB8888);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    return b;
+}
+
+static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+    struct window *w = data;
+    xdg_surface_ack_configure(xdg_surface, serial);
+    // The first buffer maps the window. Later configures come from arranges
+    // and only need an ack
+    if (!w->configured) wl_surface_attach(w->surface, buffer, 0, 0);
+    wl_surface_commit(w->surface);
+    w->configured = true;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+    .configure = xdg_surface_configure,
+};
+
+static void toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+        int32_t width, int32_t height, struct wl_array *states) {
+}
+
+static void toplevel_close(void *data, struct xdg_toplevel *toplevel) {
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+    .configure = toplevel_configure,
+    .close = toplevel_close,
+};
+
+static bool window_open(struct window *w) {
+    uint64_t start = now_ns();
+    memset(w, 0, sizeof(*w));
+    w->surface = wl_compositor_create_surface(compositor);
+    w->xdg_surface = xdg_wm_base_get_xdg_surface(wm_base, w->surface);
+    xdg_surface_add_listener(w->xdg_surface, &xdg_surface_listener, w);
+    w->toplevel = xdg_surface_get_toplevel(w->xdg_surface);
+    xdg_toplevel_add_listener(w->toplevel, &toplevel_listener, w);
+    xdg_toplevel_set_title(w->toplevel, "stress");
+    xdg_toplevel_set_app_id(w->toplevel, "wlc-stress");
+    wl_surface_commit(w->surface);
+
+    while (!w->configured) {
+        if (wl_display_dispatch(display) < 0) return false;
+    }
+    // wlc has handled the commit with the first buffer once this returns
+    if (wl_display_roundtrip(display) < 0) return false;
+    record(OP_MAP, start);
+    return true;
+}
+
+static bool window_close(struct window *w) {
+    uint64_t start = now_ns();
+    xdg_toplevel_destroy(w->toplevel);
+    xdg_surface_destroy(w->xdg_surface);
+    wl_surface_destroy(w->surface);
+    w->surface = NULL;
+    if (wl_display_roundtrip(display) < 0) return false;
+    record(OP_UNMAP, start);
+    return true;
+}
+
+static bool ipc_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, path);
+
+    ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ipc_fd < 0 || connect(ipc_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        return false;
+    }
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(ipc_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) wlc_pid = cred.pid;
+    return true;
+}
+
+// Sends one request and reads the reply up to its final "ok" or "error" line.
+// reply holds the lines before it. Returns false on error
+static bool ipc_request(const char *req, char *reply, size_t size) {
+    static char buf[IPC_BUF];
+    size_t len = strlen(req);
+    if (send(ipc_fd, req, len, MSG_NOSIGNAL) != (ssize_t) len
+            || send(ipc_fd, "\n", 1, MSG_NOSIGNAL) != 1) {
+        fprintf(stderr, "IPC send failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    size_t n = 0;
+    for (;;) {
+        ssize_t r = recv(ipc_fd, buf + n, sizeof(buf) - 1 - n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0 || n + r == sizeof(buf) - 1) {
+            fprintf(stderr, "IPC connection lost\n");
+            exit(1);
+        }
+        n += r;
+        buf[n] = '\0';
+        if (buf[n - 1] != '\n') continue;
+
+        // Start of the last line
+        char *last = buf + n - 1;
+        while (last > buf && last[-1] != '\n') --last;
+        bool ok = !strncmp(last, "ok", 2);
+        if (!ok && strncmp(last, "error", 5)) continue;
+
+        if (!ok) fprintf(stderr, "%s: %s", req, last);
+        if (reply) {
+            size_t rlen = last - buf < (ptrdiff_t) size ? last - buf : size - 1;
+            memcpy(reply, buf, rlen);
+            reply[rlen] = '\0';
+        }
+        return ok;
+    }
+}
+
+// Ids of every client wlc knows about
+static size_t client_ids(uint32_t *ids, size_t max) {
+    static char reply[IPC_BUF];
+    if (!ipc_request("clients", reply, sizeof(reply))) return 0;
+    size_t n = 0;
+    char *save;
+    for (char *l = strtok_r(reply, "\n", &save); l && n < max; l = strtok_r(NULL, "\n", &save)) {
+        ids[n++] = strtoul(l, NULL, 10);
+    }
+    return n;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct(struct samples *s, double p) {
+    return s->ns[(size_t) (p * (s->len - 1))] / 1e6;
+}
+
+static void report() {
+    printf("%-14s %8s %10s %9s %9s %9s %9s\n",
+            "op", "count", "ops/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int i = 0; i < OP_COUNT; ++i) {
+        struct samples *s = &samples[i];
+        if (!s->len) continue;
+        qsort(s->ns, s->len, sizeof(uint64_t), cmp_u64);
+        printf("%-14s %8zu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+                op_names[i], s->len, s->len * 1e9 / s->total,
+                pct(s, 0.5), pct(s, 0.99), pct(s, 0.999), s->ns[s->len - 1] / 1e6);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t rounds = 10;
+    uint32_t per_round = 200;
+    uint32_t live = 16;
+    uint32_t tag_ops = 500;
+    uint32_t hotplugs = 4;
+    bool quit = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:w:t:o:q")) != -1) {
+        switch (opt) {
+        case 'r': rounds = strtoul(optarg, NULL, 10); break;
+        case 'n': per_round = strtoul(optarg, NULL, 10); break;
+        case 'w': live = strtoul(optarg, NULL, 10); break;
+        case 't': tag_ops = strtoul(optarg, NULL, 10); break;
+        case 'o': hotplugs = strtoul(optarg, NULL, 10); break;
+        case 'q': quit = true; break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rounds] [-n maps per round] [-w live windows]"
+                    " [-t tag ops per round] [-o outputs per round] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!live) live = 1;
+
+    const char *sock = getenv("WLC_SOCK");
+    if (!sock || !ipc_connect(sock)) {
+        fprintf(stderr, "Could not connect to WLC_SOCK\n");
+        return 1;
+    }
+
+    display = wl_display_connect(NULL);
+    if (!display) {
+        fprintf(stderr, "Could not connect to the Wayland display\n");
+        return 1;
+    }
+    struct wl_registry *registry = wl_display_get_registry(display);
+    wl_registry_add_listener(registry, &registry_listener, NULL);
+    wl_display_roundtrip(display);
+    if (!compositor || !shm || !wm_base || !(buffer = create_buffer())) {
+        fprintf(stderr, "Missing wl_compositor, wl_shm or xdg_wm_base\n");
+        return 1;
+    }
+
+    struct window *windows = calloc(live, sizeof(struct window));
+    uint32_t *ids = calloc(IPC_BUF, sizeof(uint32_t));
+    char (*names)[64] = calloc(hotplugs ? hotplugs : 1, sizeof(*names));
+    uint32_t next = 0; // Oldest window, opened over next
+    srand(1);
+
+    long rss_start = rss_kib(wlc_pid);
+    printf("wlc pid %d, %ld KiB at start\n", wlc_pid, rss_start);
+
+    for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint32_t i = 0; i < per_round; ++i) {
+            struct window *w = &windows[next];
+            next = (next + 1) % live;
+            if (w->surface && !window_close(w)) goto lost;
+            if (!window_open(w)) goto lost;
+        }
+
+        size_t n = client_ids(ids, IPC_BUF);
+        char req[128];
+        for (uint32_t i = 0; i < tag_ops && n; ++i) {
+            uint64_t start = now_ns();
+            if (i % 2) {
+                snprintf(req, sizeof(req), "view %d", 1 + rand() % 255);
+                ipc_request(req, NULL, 0);
+                record(OP_VIEW, start);
+            } else {
+                snprintf(req, sizeof(req), "tag %u %d", ids[rand() % n], 1 + rand() % 255);
+                ipc_request(req, NULL, 0);
+                record(OP_TAG, start);
+            }
+        }
+        ipc_request("view 1", NULL, 0);
+
+        memset(names, 0, hotplugs * sizeof(*names));
+        for (uint32_t i = 0; i < hotplugs; ++i) {
+            uint64_t start = now_ns();
+            if (!ipc_request("output_add 640 480", names[i], sizeof(names[i]))) break;
+            names[i][strcspn(names[i], "\n")] = '\0';
+            record(OP_OUTPUT_ADD, start);
+        }
+        for (uint32_t i = 0; i < hotplugs; ++i) {
+            if (!names[i][0] || names[i][0] == '-') continue;
+            uint64_t start = now_ns();
+            snprintf(req, sizeof(req), "output_remove %s", names[i]);
+            ipc_request(req, NULL, 0);
+            record(OP_OUTPUT_REMOVE, start);
+        }
+
+        long rss = rss_kib(wlc_pid);
+        printf("round %u: %ld KiB (%+ld)\n", r + 1, rss, rss - rss_start);
+        fflush(stdout);
+    }
+
+    for (uint32_t i = 0; i < live; ++i) {
+        if (windows[i].surface && !window_close(&windows[i])) goto lost;
+    }
+    long rss_end = rss_kib(wlc_pid);
+
+    report();
+    printf("RSS %ld KiB -> %ld KiB, %+.1f KiB per round\n",
+            rss_start, rss_end, rounds ? (rss_end - rss_start) / (double) rounds : 0);
+
+    wl_buffer_destroy(buffer);
+    wl_display_disconnect(display);
+    if (quit) ipc_request("quit", NULL, 0);
+    close(ipc_fd);
+    free(windows);
+    free(ids);
+    free(names);
+    for (int i = 0; i < OP_COUNT; ++i) free(samples[i].ns);
+    return 0;
+
+lost:
+    fprintf(stderr, "Lost the Wayland connection\n");
+    report();
+    return 1;
+}
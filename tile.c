@@ -1,42 +1,37 @@
 #include "wlc.h"
-void tile() {
-    struct wlc_client *c;
-    uint32_t nc = 0;
-    wl_list_for_each(c, &lstack, llink) {
-        if (visible(c, foutput)) ++nc;
-    }
-
-    uint32_t ow = foutput->geom->width;
-    uint32_t oh = foutput->geom->height;
+void tile(struct wlc_output *o, uint32_t nc, struct wlr_box *slots) {
+    uint32_t ow = o->geom->width;
+    uint32_t oh = o->geom->height;
 
-    double_t mh = oh / (double_t) foutput->n_master;
+    double_t mh = oh / (double_t) o->n_master;
     double_t mw = ow;
     double_t ch = 0;
     uint32_t mx = 0;
     uint32_t my = 0;
 
-    if (nc > foutput->n_master) {
-        mw *= foutput->f_master; 
-        ch = oh / (double_t) (nc - foutput->n_master);
+    if (nc > o->n_master) {
+        mw *= o->f_master; 
+        ch = oh / (double_t) (nc - o->n_master);
     }
 
     double_t cw = ow - mw;
     uint32_t cx = mw;
     uint32_t cy = 0;
 
-    uint32_t n = 0;
-    wl_list_for_each(c, &lstack, llink) {
-        if (!visible(c, foutput)) continue; 
-        if (n < foutput->n_master) {
-            resize(c, mw, mh);
-            move(c, mx, my);
+    for (uint32_t n = 0; n < nc; ++n) {
+        if (n < o->n_master) {
+            slots[n].x = mx;
+            slots[n].y = my;
+            slots[n].width = mw;
+            slots[n].height = mh;
             my += mh;
-            ++n;
             continue;
         }
 
-        resize(c, cw, ch);
-        move(c, cx, cy);
+        slots[n].x = cx;
+        slots[n].y = cy;
+        slots[n].width = cw;
+        slots[n].height = ch;
         cy += ch;
     }
 }
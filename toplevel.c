@@ -0,0 +1,158 @@
+/******************************************************************************
+ * File:             toplevel.c
+ *
+ * Description:      wlr-foreign-toplevel-management for panels and switchers
+ *****************************************************************************/
+
+/* NOTE
+ * Every managed client gets a toplevel handle while it is mapped. Changes are
+ * never sent as they happen. Anything that may change what a panel shows only
+ * schedules one flush at the end of the dispatch, which compares each client
+ * with what was last published and sends only the fields that changed.
+ * Unchanged fields cost nothing. wlc never sends done itself, each
+ * wlr_foreign_toplevel_handle_v1_set_* call has wlroots schedule the done
+ * event for its handle.
+ *
+ * title       client title
+ * app_id      xdg app_id, or the class of X11 windows
+ * activated   client has keyboard focus
+ * minimized   client is on tags its output does not show
+ * output      the client's output
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "wlc.h"
+
+static struct wlr_foreign_toplevel_manager_v1 *manager;
+static struct wl_event_loop *loop;
+static struct wl_event_source *flush_source;
+
+static bool update_string(char **last, const char *now) {
+    if (!now) now = "";
+    if (*last && !strcmp(*last, now)) return false;
+    free(*last);
+    *last = strdup(now);
+    return true;
+}
+
+// Publishes what changed about c since the last flush
+static void toplevel_update(struct wlc_client *c, struct wlr_surface *focused) {
+    struct wlr_foreign_toplevel_handle_v1 *h = c->toplevel;
+
+    if (update_string(&c->ft_title, client_title(c))) {
+        wlr_foreign_toplevel_handle_v1_set_title(h, c->ft_title);
+    }
+    if (update_string(&c->ft_app_id, client_app_id(c))) {
+        wlr_foreign_toplevel_handle_v1_set_app_id(h, c->ft_app_id);
+    }
+
+    bool activated = focused && client_surface(c) == focused;
+    if (activated != c->ft_activated) {
+        c->ft_activated = activated;
+        wlr_foreign_toplevel_handle_v1_set_activated(h, activated);
+    }
+
+    bool minimized = c->output && !visible(c, c->output);
+    if (minimized != c->ft_minimized) {
+        c->ft_minimized = minimized;
+        wlr_foreign_toplevel_handle_v1_set_minimized(h, minimized);
+    }
+
+    struct wlr_output *output = c->output ? c->output->wlr_output : NULL;
+    if (output != c->ft_output) {
+        if (c->ft_output) wlr_foreign_toplevel_handle_v1_output_leave(h, c->ft_output);
+        if (output) wlr_foreign_toplevel_handle_v1_output_enter(h, output);
+        c->ft_output = output;
+    }
+}
+
+static void toplevel_flush(void *data) {
+    flush_source = NULL;
+    struct wlr_surface *focused = focused_surface();
+    struct wlc_client *c;
+    wl_list_for_each(c, &lstack, llink) {
+        if (c->toplevel) toplevel_update(c, focused);
+    }
+}
+
+// Schedules a flush at the end of the current dispatch. Cheap enough to call
+// on every change
+void toplevel_schedule() {
+    if (flush_source || !manager) return;
+    flush_source = wl_event_loop_add_idle(loop, toplevel_flush, NULL);
+}
+
+// Panel asked to show and focus c. A client on hidden tags brings its tags
+// into view first
+static void toplevel_request_activate(struct wl_listener *listener, void *data) {
+    struct wlc_client *c = wl_container_of(listener, c, toplevel_activate);
+    struct wlc_output *o = c->output;
+    if (o && !visible(c, o)) {
+        o->tag = c->tag;
+        wlr_output_damage_add_whole(o->wlr_damage);
+        update_all_client_outputs();
+        invalidate_plans();
+        toplevel_schedule();
+        idle_schedule();
+        schedule_arrange(o);
+    }
+    focus_client(c, client_surface(c));
+}
+
+static void toplevel_request_close(struct wl_listener *listener, void *data) {
+    struct wlc_client *c = wl_container_of(listener, c, toplevel_close);
+    client_close(c);
+}
+
+// Creates the toplevel handle of a client that was just mapped
+void toplevel_create(struct wlc_client *c) {
+    if (!manager || c->unmanaged) return;
+    c->toplevel = wlr_foreign_toplevel_handle_v1_create(manager);
+    if (!c->toplevel) return;
+    c->toplevel_activate.notify = toplevel_request_activate;
+    wl_signal_add(&c->toplevel->events.request_activate, &c->toplevel_activate);
+    c->toplevel_close.notify = toplevel_request_close;
+    wl_signal_add(&c->toplevel->events.request_close, &c->toplevel_close);
+    toplevel_schedule();
+}
+
+// Destroys the toplevel handle of a client that is being unmapped
+void toplevel_destroy(struct wlc_client *c) {
+    if (!c->toplevel) return;
+    wl_list_remove(&c->toplevel_activate.link);
+    wl_list_remove(&c->toplevel_close.link);
+    wlr_foreign_toplevel_handle_v1_destroy(c->toplevel);
+    c->toplevel = NULL;
+
+    free(c->ft_title);
+    free(c->ft_app_id);
+    c->ft_title = NULL;
+    c->ft_app_id = NULL;
+    c->ft_activated = false;
+    c->ft_minimized = false;
+    c->ft_output = NULL;
+}
+
+// Forgets an output that is going away. wlroots already removed it from the
+// handles
+void toplevel_output_destroyed(struct wlc_output *o) {
+    struct wlc_client *c;
+    wl_list_for_each(c, &lstack, llink) {
+        if (c->ft_output == o->wlr_output) c->ft_output = NULL;
+    }
+    toplevel_schedule();
+}
+
+bool toplevel_init(struct wl_display *display) {
+    manager = wlr_foreign_toplevel_manager_v1_create(display);
+    loop = wl_display_get_event_loop(display);
+    return manager != NULL;
+}
+
+// Outputs destroyed with the display must not schedule anything after this
+void toplevel_finish() {
+    if (flush_source) wl_event_source_remove(flush_source);
+    flush_source = NULL;
+    manager = NULL;
+}
@@ -16,16 +16,29 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
 #include <wayland-server-protocol.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
 #include <wlr/backend.h>
+#include <wlr/backend/headless.h>
+#include <wlr/backend/multi.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_matrix.h>
 #include <wlr/types/wlr_output_layout.h>
+#include <wlr/types/wlr_output_management_v1.h>
+#include <wlr/types/wlr_pointer_constraints_v1.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
+#include <wlr/types/wlr_screencopy_v1.h>
 #include <wlr/types/wlr_seat.h>
+#include <wlr/types/wlr_viewporter.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_decoration_v1.h>
+#include <wlr/types/wlr_xdg_output_v1.h>
+#include <wlr/util/region.h>
+#include <wlr/xcursor.h>
 // #include <wlr/util/log.h>
 
 #include "wlc.h"
@@ -37,22 +50,33 @@
 
 // static struct wl_list lstack; // Client layout configuration (size and positioning)
 struct wl_list lstack;
-static struct wl_list fstack; // Client focusing
+struct wl_list fstack; // Client focusing
 static struct wl_list zstack; // Client stacking
 
 static struct wl_display *display;
 static struct wlr_backend *backend;
 static struct wlr_renderer *renderer;
-static struct wl_list outputs;
+static struct wlr_compositor *compositor;
+struct wl_list outputs;
 static struct wl_listener new_output;
 static struct wlr_output_layout *output_layout;
 struct wlc_output *foutput;
+static struct wlr_output_manager_v1 *output_manager;
+static struct wl_listener layout_change;
+static struct wl_listener new_surface;
+static uint64_t plan_serial = 1; // Render plans built for an older serial are stale
+static struct wl_listener output_manager_apply;
+static struct wl_listener output_manager_test;
 
 static struct wlr_xdg_shell *xdg_shell;
 static struct wl_listener new_xdg_surface;
+static struct wlr_xdg_decoration_manager_v1 *decoration_manager;
+static struct wl_listener new_decoration;
 
 static struct wlr_cursor *csr;
 static struct wlr_xcursor_manager *cursor_mgr;
+static const char *cursor_image; // Theme image shown, NULL while a client sets the cursor
+static bool cursor_scales_changed = true; // Output scales without a loaded theme may exist
 static struct wl_listener cursor_motion;
 static struct wl_listener cursor_motion_absolute;
 static struct wl_listener cursor_button;
@@ -60,20 +84,36 @@ static struct wl_listener cursor_axis;
 static struct wl_listener cursor_frame;
 static struct wlr_seat *seat;
 static struct wl_listener request_cursor;
+static struct wlr_relative_pointer_manager_v1 *relative_pointer_manager;
+static struct wlr_pointer_constraints_v1 *pointer_constraints;
+static struct wl_listener new_constraint;
+static struct wlr_pointer_constraint_v1 *active_constraint;
 static struct wl_listener new_input;
 static struct wl_list keyboards;
 
 // Grabbed client
 static struct wlc_client *gc;
-static uint32_t gcx;
-static uint32_t gcy;
+static double_t gcx;
+static double_t gcy;
+static struct wlr_box gbox; // Grabbed client geometry when the grab started
+static uint32_t gedges; // Edges being dragged by an interactive resize
 
 static uint8_t cursor_mode;
 
-/*
+static struct wl_event_source *arrange_source; // Pending deferred arrange
+static uint32_t next_client_id = 1;
+static uint32_t output_bits; // Bits in use by wlc_output.bit
+static struct timespec start_time;
+static const char *startup_cmd; // Spawned once the compositor runs, see -x
+
+#ifdef XWAYLAND
+static struct wlr_xwayland *xwayland;
+static struct wl_listener new_xwayland_surface;
+static struct wl_listener xwayland_ready;
+#endif
+
 static void xdg_toplevel_request_resize(struct wl_listener *listener, void *data);
 static void xdg_toplevel_request_move(struct wl_listener *listener, void *data);
-*/
 
 
 static bool run();
@@ -92,10 +132,47 @@ static void new_output_notify(struct wl_listener *listener, void *data);
 static void new_xdg_surface_notify(struct wl_listener *listener, void *data);
 static void output_destroy_notify(struct wl_listener *listener, void *data);
 static void output_frame_notify(struct wl_listener *listener, void *data);
-static void process_cursor_motion(uint32_t time);
-static void render_surface(struct wlr_surface *surface, int x, int y, void *data);
-static void scale_box(struct wlr_box *box, uint32_t scale);
+static void output_manager_apply_notify(struct wl_listener *listener, void *data);
+static void output_manager_test_notify(struct wl_listener *listener, void *data);
+static void apply_output_config(struct wlr_output_configuration_v1 *config, bool test_only);
+static void place_output(struct wlc_output *o, struct wlr_output_configuration_head_v1 *head);
+static void update_output_manager();
+static struct wlr_output_mode *choose_mode(struct wlr_output *wo);
+static bool configure_output(struct wlr_output *wo, const struct wlc_output_rule *rule);
+static void process_cursor_motion(uint32_t time, 
+        struct wlr_input_device *dev, 
+        double_t dx, 
+        double_t dy, 
+        double_t dx_unaccel, 
+        double_t dy_unaccel);
+static void new_constraint_notify(struct wl_listener *listener, void *data);
+static void constraint_destroy_notify(struct wl_listener *listener, void *data);
+static void activate_constraint(struct wlr_pointer_constraint_v1 *constraint);
+static void plan_surface(struct wlr_surface *surface, int x, int y, void *data);
+static void build_plan(struct wlc_output *o);
+static void render_plan(struct wlc_output *o, pixman_region32_t *damage);
+static void new_surface_notify(struct wl_listener *listener, void *data);
+static void layout_change_notify(struct wl_listener *listener, void *data);
+static void scale_box(struct wlr_box *box, float scale);
+static void scissor_output(struct wlr_output *o, pixman_box32_t *rect);
+static void send_frame_done(struct wlc_output *o, struct timespec *when);
 static void seat_request_cursor(struct wl_listener *listener, void *data);
+static void set_cursor_image(const char *name);
+static void xdg_surface_commit_notify(struct wl_listener *listener, void *data);
+static struct wlc_child *child_create(struct wlc_client *c, struct wlr_surface *surface);
+static void child_commit_notify(struct wl_listener *listener, void *data);
+static void child_map_notify(struct wl_listener *listener, void *data);
+static void child_unmap_notify(struct wl_listener *listener, void *data);
+static void child_update_outputs(struct wlc_child *ch);
+static void child_destroy_notify(struct wl_listener *listener, void *data);
+static void child_destroy(struct wlc_child *ch);
+static void child_new_subsurface_notify(struct wl_listener *listener, void *data);
+static void child_new_popup_notify(struct wl_listener *listener, void *data);
+static void child_reposition_notify(struct wl_listener *listener, void *data);
+static void client_new_subsurface_notify(struct wl_listener *listener, void *data);
+static void client_new_popup_notify(struct wl_listener *listener, void *data);
+static void subsurface_child(struct wlc_client *c, struct wlr_subsurface *subsurface);
+static void popup_child(struct wlc_client *c, struct wlr_xdg_popup *popup);
 static void xdg_surface_destroy_notify(struct wl_listener *listener, void *data);
 static void xdg_surface_map_notify(struct wl_listener *listener, void *data);
 static void xdg_surface_unmap_notify(struct wl_listener *listener, void *data);
@@ -111,17 +188,49 @@ static void find_surface(struct wlc_client *client,
         struct wlr_surface **surface, 
         double_t *sx,
         double_t *sy);
-static void focus_client(struct wlc_client *client, struct wlr_surface *surface);
 static void toggle_tag(uint16_t tag);
+static struct wlr_box *layout_cache_lookup(struct wlc_output *o, uint32_t nc);
+static void arrange_idle(void *data);
 static void move_resize(enum wlc_cursor_mode);
+static void begin_grab(struct wlc_client *c, enum wlc_cursor_mode mode, uint32_t edges);
+static void end_grab();
+static void flush_resize(struct wlc_client *c);
+static void damage_box(struct wlc_output *o, struct wlr_box *box);
+static void damage_client(struct wlc_client *c);
+static void damage_framed(struct wlc_client *c, struct wlr_box *box);
+static void plan_borders(struct wlc_output *o);
+static void render_borders(struct wlc_output *o, pixman_region32_t *damage);
+static void new_decoration_notify(struct wl_listener *listener, void *data);
+static void client_name_notify(struct wl_listener *listener, void *data);
 static struct wlc_output* cursor_to_output(double_t csrx, double_t csry);
 static inline void listen(struct wl_listener* l, void (*h)(), struct wl_signal* s);
 static inline void set_lstack_head(struct wlc_client *c);
 static inline void set_fstack_head(struct wlc_client *c);
 static inline void set_zstack_head(struct wlc_client *c);
+static void client_get_geometry(struct wlc_client *c, struct wlr_box *box);
+static uint32_t client_configure(struct wlc_client *c, int w, int h);
+static void client_activate(struct wlc_client *c, bool activated);
+static void client_set_resizing(struct wlc_client *c, bool resizing);
+static void client_for_each_surface(struct wlc_client *c, 
+        wlr_surface_iterator_func_t iterator, 
+        void *data);
+static struct wlr_surface *client_surface_at(struct wlc_client *c, 
+        double_t x, 
+        double_t y, 
+        double_t *sx, 
+        double_t *sy);
+static void deactivate_surface(struct wlr_surface *s);
+static long rss_kib(pid_t pid);
+static double_t ms_since(struct timespec *t);
+#ifdef XWAYLAND
+static void new_xwayland_surface_notify(struct wl_listener *listener, void *data);
+static void x11_request_configure(struct wl_listener *listener, void *data);
+static void x11_request_resize(struct wl_listener *listener, void *data);
+static void xwayland_ready_notify(struct wl_listener *listener, void *data);
+#endif
 
 inline uint8_t visible(struct wlc_client *c, struct wlc_output *o) {
-    return c->output == o && c->tag & o->tag;
+    return o && c->output == o && c->tag & o->tag;
 }
 
 inline void set_lstack_head(struct wlc_client *c) {
@@ -135,8 +244,10 @@ inline void set_fstack_head(struct wlc_client *c) {
 }
 
 inline void set_zstack_head(struct wlc_client *c) {
+    if (zstack.next == &c->zlink) return;
     wl_list_remove(&c->zlink);
     wl_list_insert(&zstack, &c->zlink);
+    invalidate_plans();
 }
 
 inline void listen(struct wl_listener* l, void (*h)(), struct wl_signal* s) {
@@ -144,8 +255,143 @@ inline void listen(struct wl_listener* l, void (*h)(), struct wl_signal* s) {
     wl_signal_add(s, l);
 }
 
+// A client is either an xdg toplevel or an X11 window. The client_* helpers
+// hide the difference from the rest of the compositor
+struct wlr_surface *client_surface(struct wlc_client *c) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) return c->xsurface->surface;
+#endif
+    return c->xdg_surface->surface;
+}
+
+// Surface with keyboard focus, NULL if none
+struct wlr_surface *focused_surface() {
+    return seat->keyboard_state.focused_surface;
+}
+
+// Whether s belongs to a client shown on an output
+bool surface_shown(struct wlr_surface *s) {
+    struct wlr_surface *root = wlr_surface_get_root_surface(s);
+    struct wlc_client *c;
+    wl_list_for_each(c, &zstack, zlink) {
+        if (client_surface(c) == root) return visible(c, c->output);
+    }
+    return false;
+}
+
+// Application id of the client, the window class for X11 windows
+const char *client_app_id(struct wlc_client *c) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) return c->xsurface->class;
+#endif
+    return c->xdg_surface->toplevel->app_id;
+}
+
+// Asks the client to close its window
+void client_close(struct wlc_client *c) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) {
+        wlr_xwayland_surface_close(c->xsurface);
+        return;
+    }
+#endif
+    wlr_xdg_toplevel_send_close(c->xdg_surface);
+}
+
+const char *client_title(struct wlc_client *c) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) return c->xsurface->title;
+#endif
+    return c->xdg_surface->toplevel->title;
+}
+
+// Window geometry of the client. X11 windows report layout coordinates
+void client_get_geometry(struct wlc_client *c, struct wlr_box *box) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) {
+        box->x = c->xsurface->x;
+        box->y = c->xsurface->y;
+        box->width = c->xsurface->width;
+        box->height = c->xsurface->height;
+        return;
+    }
+#endif
+    wlr_xdg_surface_get_geometry(c->xdg_surface, box);
+}
+
+// Asks the client to use size w x h at its current position. Returns the
+// configure serial, or 0 for X11 windows which do not ack configures
+uint32_t client_configure(struct wlc_client *c, int w, int h) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) {
+        int ox = c->output ? c->output->geom->x : 0;
+        int oy = c->output ? c->output->geom->y : 0;
+        wlr_xwayland_surface_configure(c->xsurface, 
+                ox + c->geom.x, 
+                oy + c->geom.y, 
+                w, 
+                h);
+        return 0;
+    }
+#endif
+    return wlr_xdg_toplevel_set_size(c->xdg_surface, w, h);
+}
+
+void client_activate(struct wlc_client *c, bool activated) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) {
+        wlr_xwayland_surface_activate(c->xsurface, activated);
+        return;
+    }
+#endif
+    wlr_xdg_toplevel_set_activated(c->xdg_surface, activated);
+}
+
+void client_set_resizing(struct wlc_client *c, bool resizing) {
+    if (c->type == WLC_XDG) wlr_xdg_toplevel_set_resizing(c->xdg_surface, resizing);
+}
+
+void client_for_each_surface(struct wlc_client *c, 
+        wlr_surface_iterator_func_t iterator, 
+        void *data) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) {
+        wlr_surface_for_each_surface(c->xsurface->surface, iterator, data);
+        return;
+    }
+#endif
+    wlr_xdg_surface_for_each_surface(c->xdg_surface, iterator, data);
+}
+
+struct wlr_surface *client_surface_at(struct wlc_client *c, 
+        double_t x, 
+        double_t y, 
+        double_t *sx, 
+        double_t *sy) {
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) return wlr_surface_surface_at(c->xsurface->surface, x, y, sx, sy);
+#endif
+    return wlr_xdg_surface_surface_at(c->xdg_surface, x, y, sx, sy);
+}
+
+// Deactivates the toplevel or X11 window owning surface s
+void deactivate_surface(struct wlr_surface *s) {
+    if (wlr_surface_is_xdg_surface(s)) {
+        struct wlr_xdg_surface *xdg_surface = wlr_xdg_surface_from_wlr_surface(s);
+        if (xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
+            wlr_xdg_toplevel_set_activated(xdg_surface, false);
+        }
+    }
+#ifdef XWAYLAND
+    else if (wlr_surface_is_xwayland_surface(s)) {
+        wlr_xwayland_surface_activate(wlr_xwayland_surface_from_wlr_surface(s), false);
+    }
+#endif
+}
+
 void swap_master() {
     struct wlc_client *cc = fstack_top();
+    if (!cc) return;
     struct wlc_client *c;
     wl_list_for_each(c, &lstack, llink) {
         if (visible(c, foutput)) { // master
@@ -167,21 +413,23 @@ void focus_next(int8_t dir){
     struct wlc_client *cc = fstack_top();
     if (!cc) return;
     
+    // Walks around lstack starting after cc, passing over the list head. Stops
+    // back at cc if no other client is visible
     struct wlc_client *c;
     if (dir > 0) {
         wl_list_for_each(c, &cc->llink, llink) {
-            if (&c->llink == &cc->llink) continue;
+            if (&c->llink == &lstack) continue;
             if (visible(c, foutput)) break; 
         }
     }
     else {
         wl_list_for_each_reverse(c, &cc->llink, llink) {
-            if (&c->llink == &cc->llink) continue;
+            if (&c->llink == &lstack) continue;
             if (visible(c, foutput)) break; 
         }
     }
 
-    if (c) focus_client(c, c->xdg_surface->surface);
+    if (&c->llink != &cc->llink) focus_client(c, client_surface(c));
 }
 
 /*
@@ -229,6 +477,41 @@ void tile() {
 }
 */
 
+// Damages box, given in output local coordinates, on output o
+void damage_box(struct wlc_output *o, struct wlr_box *box) {
+    if (!o || !o->wlr_damage || o->powered_off) return;
+    struct wlr_box b = *box;
+    scale_box(&b, o->wlr_output->scale);
+    wlr_output_damage_add_box(o->wlr_damage, &b);
+}
+
+// Damages box, an area of client c in output local coordinates, together with
+// the border drawn around it
+void damage_framed(struct wlc_client *c, struct wlr_box *box) {
+    struct wlr_box b = *box;
+    int bw = c->unmanaged ? 0 : border_width;
+    b.x -= bw;
+    b.y -= bw;
+    b.width += 2 * bw;
+    b.height += 2 * bw;
+    damage_box(c->output, &b);
+}
+
+static void damage_surface_box(struct wlr_surface *s, int x, int y, void *data) {
+    struct wlc_client *c = data;
+    struct wlr_box box = { c->geom.x + x, c->geom.y + y, s->current.width, s->current.height };
+    damage_box(c->output, &box);
+}
+
+// Damages the area covered by the client's border and by all of its surfaces.
+// Buffers can reach past the window geometry, for example with CSD shadows
+void damage_client(struct wlc_client *c) {
+    if (!c->output || !visible(c, c->output)) return;
+    struct wlr_box box = { c->geom.x, c->geom.y, c->cw, c->ch };
+    damage_framed(c, &box);
+    client_for_each_surface(c, damage_surface_box, c);
+}
+
 struct wlc_client* fstack_top() {
     struct wlc_client *c;
     wl_list_for_each(c, &fstack, flink) {
@@ -238,14 +521,170 @@ struct wlc_client* fstack_top() {
 }
 
 void move(struct wlc_client *c, uint32_t x, uint32_t y) {
+    if (c->geom.x == x && c->geom.y == y) return;
+    damage_client(c);
     c->geom.x = x;
     c->geom.y = y;
+    damage_client(c);
+    update_client_outputs(c);
+    invalidate_plans();
+    // X11 windows need to know where they are for input
+    if (c->type == WLC_X11) client_configure(c, c->geom.width, c->geom.height);
 }
 
 void resize(struct wlc_client *c, double_t w, double_t h) {
     c->geom.width = w;
     c->geom.height = h;
-    wlr_xdg_toplevel_set_size(c->xdg_surface, w, h);
+    client_configure(c, w, h);
+}
+
+// Returns the slot boxes of the current layout of output o for nc visible
+// clients. Results are memoized in the output's LRU so the layout function only
+// runs when the output size, master parameters or client count change
+struct wlr_box *layout_cache_lookup(struct wlc_output *o, uint32_t nc) {
+    struct wlc_layout_cache_entry *lru = &o->cache[0];
+    ++o->cache_tick;
+
+    for (int i = 0; i < LAYOUT_CACHE_SIZE; ++i) {
+        struct wlc_layout_cache_entry *e = &o->cache[i];
+        if (e->used && e->layout == o->layout && e->nc == nc
+                && e->width == o->geom->width
+                && e->height == o->geom->height
+                && e->n_master == o->n_master
+                && e->f_master == o->f_master) {
+            e->used = o->cache_tick;
+            ++o->cache_hits;
+            return e->slots;
+        }
+        if (e->used < lru->used) lru = e;
+    }
+
+    // Miss. Evict the least recently used entry and recompute into it
+    ++o->cache_misses;
+    struct wlr_box *slots = realloc(lru->slots, nc * sizeof(struct wlr_box));
+    if (!slots) {
+        ERROR("Could not allocate layout slots");
+        return NULL;
+    }
+    lru->slots = slots;
+    lru->layout = o->layout;
+    lru->width = o->geom->width;
+    lru->height = o->geom->height;
+    lru->n_master = o->n_master;
+    lru->f_master = o->f_master;
+    lru->nc = nc;
+    lru->used = o->cache_tick;
+    layouts[o->layout].l(o, nc, slots);
+    return slots;
+}
+
+// Returns layout i, or NULL if there is no such layout
+struct wlc_layout *get_layout(uint32_t i) {
+    if (i >= sizeof(layouts) / sizeof(layouts[0])) return NULL;
+    return &layouts[i];
+}
+
+// Arrange the visible clients of the output with its current layout. Only the
+// client to slot assignment is done here, slot boxes come from the cache
+void arrange(struct wlc_output *o) {
+    if (!o || !layouts[o->layout].l) return;
+
+    struct wlc_client *c;
+    uint32_t nc = 0;
+    wl_list_for_each(c, &lstack, llink) {
+        if (visible(c, o)) ++nc;
+    }
+    if (nc == 0) return;
+
+    struct wlr_box *slots = layout_cache_lookup(o, nc);
+    if (!slots) return;
+
+    uint32_t n = 0;
+    wl_list_for_each(c, &lstack, llink) {
+        if (!visible(c, o)) continue;
+        // Slots include the border, clients get what is inside it
+        int w = slots[n].width - 2 * (int) border_width;
+        int h = slots[n].height - 2 * (int) border_width;
+        resize(c, w > 1 ? w : 1, h > 1 ? h : 1);
+        move(c, slots[n].x + (int) border_width, slots[n].y + (int) border_width);
+        ++n;
+    }
+}
+
+// Runs at the end of the dispatch cycle and arranges every output that asked
+// for it since the last run
+void arrange_idle(void *data) {
+    arrange_source = NULL;
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        if (!o->needs_arrange) continue;
+        o->needs_arrange = false;
+        ++o->arranges;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        arrange(o);
+        o->arrange_ns = ms_since(&start) * 1e6;
+    }
+}
+
+// Marks the output as needing an arrange. Any number of requests made in one
+// dispatch cycle result in a single arrange
+void schedule_arrange(struct wlc_output *o) {
+    if (!o) return;
+    ++o->arrange_requests;
+    o->needs_arrange = true;
+    if (!arrange_source) {
+        arrange_source = wl_event_loop_add_idle(wl_display_get_event_loop(display), 
+                arrange_idle, 
+                NULL);
+    }
+}
+
+// Sends wl_surface enter and leave for the outputs the client has entered or
+// left since the last call, so it can pick the scale and refresh rate of the
+// outputs it is actually shown on. A visible client is on every output its box
+// overlaps, a hidden client is on none
+void update_client_outputs(struct wlc_client *c) {
+    uint32_t mask = 0;
+    struct wlc_output *o;
+    if (c->output && visible(c, c->output)) {
+        struct wlr_box box = {
+            .x = c->output->geom->x + c->geom.x,
+            .y = c->output->geom->y + c->geom.y,
+            .width = c->cw,
+            .height = c->ch,
+        };
+        struct wlr_box tmp;
+        wl_list_for_each(o, &outputs, link) {
+            // Outputs powered down while idle still show their clients
+            if (!o->wlr_output->enabled && !o->powered_off) continue;
+            if (wlr_box_intersection(&tmp, &box, o->geom)) mask |= o->bit;
+        }
+    }
+
+    uint32_t entered = mask & ~c->outputs;
+    uint32_t left = c->outputs & ~mask;
+    c->outputs = mask;
+    if (!entered && !left) return;
+
+    // Subsurfaces and popups follow the client while they are mapped
+    struct wlr_surface *surface = client_surface(c);
+    wl_list_for_each(o, &outputs, link) {
+        if (o->bit & entered) wlr_surface_send_enter(surface, o->wlr_output);
+        if (o->bit & left) wlr_surface_send_leave(surface, o->wlr_output);
+    }
+    struct wlc_child *ch;
+    wl_list_for_each(ch, &c->children, link) {
+        child_update_outputs(ch);
+    }
+}
+
+void update_all_client_outputs() {
+    struct wlc_client *c;
+    wl_list_for_each(c, &zstack, zlink) {
+        update_client_outputs(c);
+    }
 }
 
 // Toggle the tag. Arrange the clients visible and focus the client on top of
@@ -254,10 +693,15 @@ void toggle_tag(uint16_t t) {
     if ((foutput->tag ^ t) == 0) return;
         
     foutput->tag  ^= t;
-    if (layouts[foutput->layout].l) layouts[foutput->layout].l();
+    wlr_output_damage_add_whole(foutput->wlr_damage);
+    update_all_client_outputs();
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
+    schedule_arrange(foutput);
     struct wlc_client *c = fstack_top();
     if (c) {
-        focus_client(c, c->xdg_surface->surface);
+        focus_client(c, client_surface(c));
     }
 }
 
@@ -265,15 +709,27 @@ void toggle_tag(uint16_t t) {
 // top of the focus stack
 void switch_tag(uint16_t t) {
     foutput->tag = t;
-    if (layouts[foutput->layout].l) layouts[foutput->layout].l();
+    wlr_output_damage_add_whole(foutput->wlr_damage);
+    update_all_client_outputs();
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
+    schedule_arrange(foutput);
     struct wlc_client *c = fstack_top();
-    if (c) focus_client(c, c->xdg_surface->surface);
+    if (c) focus_client(c, client_surface(c));
 }
 
 void set_tag(uint16_t t) {
     struct wlc_client *c = fstack_top();
-    if (c) c->tag = t;
-    if (layouts[foutput->layout].l) layouts[foutput->layout].l();
+    if (c) {
+        damage_client(c);
+        c->tag = t;
+        update_client_outputs(c);
+        invalidate_plans();
+        toplevel_schedule();
+        idle_schedule();
+    }
+    schedule_arrange(foutput);
 }
 
 // Gives client keyboard focus
@@ -288,9 +744,21 @@ void focus_client(struct wlc_client *c, struct wlr_surface *surface) {
     // If there was a different previous surface
     if (prev_surface) {
         // Deactivate previously focused surface. Client will repaint
-        struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(
-            seat->keyboard_state.focused_surface);
-        wlr_xdg_toplevel_set_activated(previous, false);
+        deactivate_surface(prev_surface);
+    }
+
+    // Border colours follow focus. The previously focused client is usually
+    // the head of the focus stack
+    if (!wl_list_empty(&fstack)) {
+        struct wlc_client *prev = wl_container_of(fstack.next, prev, flink);
+        if (prev != c) damage_client(prev);
+    }
+    toplevel_schedule();
+
+    // A pointer constraint only holds while its client has keyboard focus
+    if (active_constraint && (!c ||
+                wlr_surface_get_root_surface(active_constraint->surface) != client_surface(c))) {
+        activate_constraint(NULL);
     }
 
     // If no client is to be focused
@@ -306,34 +774,50 @@ void focus_client(struct wlc_client *c, struct wlr_surface *surface) {
     // wl_list_insert(&zstack, &c->zlink);
     set_fstack_head(c);
     set_zstack_head(c);
+    damage_client(c);
 
     // Activate new surface
-    wlr_xdg_toplevel_set_activated(c->xdg_surface, true);
+    client_activate(c, true);
 
-    // Have keyboard enter surface. Key events will be sent to the correct client
+    // Have keyboard enter surface. Key events will be sent to the correct client.
+    // A seat without a keyboard, such as a headless one, still moves focus
     struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
-    wlr_seat_keyboard_notify_enter(seat, 
-            c->xdg_surface->surface,
-            keyboard->keycodes, 
-            keyboard->num_keycodes,
-            &keyboard->modifiers);
+    if (!keyboard) {
+        wlr_seat_keyboard_notify_enter(seat, client_surface(c), NULL, 0, NULL);
+    } else {
+        wlr_seat_keyboard_notify_enter(seat, 
+                client_surface(c),
+                keyboard->keycodes, 
+                keyboard->num_keycodes,
+                &keyboard->modifiers);
+    }
+
+    // Focus coming back to a client under the pointer, for example a game
+    // after alt-tab, gives it back its pointer constraint
+    struct wlr_surface *pointer_surface = seat->pointer_state.focused_surface;
+    if (pointer_surface && wlr_surface_get_root_surface(pointer_surface) == client_surface(c)) {
+        activate_constraint(wlr_pointer_constraints_v1_constraint_for_surface(
+                    pointer_constraints, pointer_surface, seat));
+    }
 }
 
 // Test if any nested surfaces are underneath layout coordinates (lx, ly). If
 // so, surface pointer is set to the wlr_surface and the surface coordinates
-// (sx, sy) to relative of that surface's top-left corner.
+// (sx, sy) to relative of that surface's top-left corner. Client geometry is
+// local to its output
 void find_surface(struct wlc_client *c, 
         double_t lx, 
         double_t ly,
         struct wlr_surface **surface, 
         double_t *sx, 
         double_t *sy) {
-    double_t csx = lx - c->geom.x;
-    double_t csy = ly - c->geom.y;
-    *surface = wlr_xdg_surface_surface_at(c->xdg_surface, csx, csy, sx, sy);
+    double_t csx = lx - c->output->geom->x - c->geom.x;
+    double_t csy = ly - c->output->geom->y - c->geom.y;
+    *surface = client_surface_at(c, csx, csy, sx, sy);
 }
 
-// Find the client under the cursor by iterating over all clients
+// Find the client under the cursor by iterating over all clients from top to
+// bottom
 // lx, ly - cursor coordinates in layout coordinates
 struct wlc_client *find_client(double_t lx, 
         double_t ly,
@@ -341,7 +825,7 @@ struct wlc_client *find_client(double_t lx,
         double_t *sx,
         double_t *sy) {
     struct wlc_client *c;
-    wl_list_for_each(c, &lstack, llink) {
+    wl_list_for_each(c, &zstack, zlink) {
         find_surface(c, lx, ly, s, sx, sy);
         if (*s && visible(c, foutput)) return c;
     }
@@ -352,12 +836,15 @@ struct wlc_client *find_client(double_t lx,
 // group pointer events together (ex. two axis events may happen at the same
 // time. Frame event will not be sent in between those events)
 void cursor_frame_notify(struct wl_listener *listener, void *data) {
+    record_event(WLC_INPUT_FRAME, NULL);
     wlr_seat_pointer_notify_frame(seat);
 }
 
 // Raised by cursor when axis event occurs (ex. scroll wheel)
 void cursor_axis_notify(struct wl_listener *listener, void *data) {
     struct wlr_event_pointer_axis *event = data;
+    record_event(WLC_INPUT_AXIS, event);
+    idle_activity();
     wlr_seat_pointer_notify_axis(seat, 
             event->time_msec, 
             event->orientation,
@@ -365,33 +852,70 @@ void cursor_axis_notify(struct wl_listener *listener, void *data) {
             event->source);
 }
 
-static void move_resize(enum wlc_cursor_mode mode) {
-    double_t sx, sy;
-    struct wlr_surface *surface;
-    gc = find_client(csr->x, csr->y, &surface, &sx, &sy);
-    if (!gc) {
-        return;
-    }
+// Starts an interactive move or resize of client c. edges are the edges
+// dragged by a resize
+void begin_grab(struct wlc_client *c, enum wlc_cursor_mode mode, uint32_t edges) {
+    gc = c;
+    gbox = c->geom;
+    gedges = edges;
 
+    // Cursor position local to the client's output
+    double_t cx = csr->x - c->output->geom->x;
+    double_t cy = csr->y - c->output->geom->y;
     switch(cursor_mode = mode) {
         case WLC_CURSOR_MOVE:
-            gcx = csr->x - gc->geom.x;
-            gcy = csr->y - gc->geom.y;
-            wlr_xcursor_manager_set_cursor_image(cursor_mgr, "fleur", csr);
+            gcx = cx - gc->geom.x;
+            gcy = cy - gc->geom.y;
+            set_cursor_image("fleur");
             break;
         case WLC_CURSOR_RESIZE:
-            wlr_cursor_warp_closest(csr, 
-                    NULL, 
-                    gc->geom.x + gc->geom.width, 
-                    gc->geom.y + gc->geom.height);
-            wlr_xcursor_manager_set_cursor_image(cursor_mgr, "bottom_right_corner", csr);
+            // Offset of the cursor from the dragged edges
+            gcx = cx - (gbox.x + (edges & WLR_EDGE_RIGHT ? gbox.width : 0));
+            gcy = cy - (gbox.y + (edges & WLR_EDGE_BOTTOM ? gbox.height : 0));
+            client_set_resizing(gc, true);
+            set_cursor_image(wlr_xcursor_get_resize_name(edges));
+            c->anchor_edges = edges;
+            c->anchor = gbox;
             break;
+        default:
+            break;
+    }
+}
+
+// Ends the current grab. The last size of a resize is still sent once the
+// client has caught up
+void end_grab() {
+    if (gc && cursor_mode == WLC_CURSOR_RESIZE) {
+        client_set_resizing(gc, false);
+        flush_resize(gc);
     }
+    set_cursor_image("left_ptr");
+    cursor_mode = WLC_CURSOR_NORMAL;
+    gc = NULL;
+}
+
+static void move_resize(enum wlc_cursor_mode mode) {
+    double_t sx, sy;
+    struct wlr_surface *surface;
+    struct wlc_client *c = find_client(csr->x, csr->y, &surface, &sx, &sy);
+    if (!c) {
+        return;
+    }
+
+    if (mode == WLC_CURSOR_RESIZE) {
+        wlr_cursor_warp_closest(csr, 
+                NULL, 
+                c->output->geom->x + c->geom.x + c->geom.width, 
+                c->output->geom->y + c->geom.y + c->geom.height);
+    }
+    begin_grab(c, mode, WLR_EDGE_BOTTOM | WLR_EDGE_RIGHT);
 }
 
 // Raised when cursor emits a button event (ex. mouse click)
 void cursor_button_notify(struct wl_listener *listener, void *data) {
     struct wlr_event_pointer_button *event = data;
+    record_event(WLC_INPUT_BUTTON, event);
+    idle_activity();
 
     double_t sx, sy;
     struct wlr_surface *s;
@@ -400,15 +924,29 @@ void cursor_button_notify(struct wl_listener *listener, void *data) {
             &s, 
             &sx, 
             &sy);
+    struct wlr_keyboard *kb = wlr_seat_get_keyboard(seat);
+    uint32_t mods = kb ? wlr_keyboard_get_modifiers(kb) : 0;
     switch(event->state) {
         case WLR_BUTTON_PRESSED:
+            // Override redirect X11 windows (menus, tooltips) only get the
+            // button, they are never focused or dragged
+            if (client && client->unmanaged) break;
             focus_client(client, s);
-            // move_resize(WLC_CURSOR_MOVE);
+            // MODKEY + left/right button drags the client under the cursor
+            if (client && (mods & MODKEY)) {
+                if (event->button == BTN_LEFT) {
+                    move_resize(WLC_CURSOR_MOVE);
+                    return;
+                }
+                if (event->button == BTN_RIGHT) {
+                    move_resize(WLC_CURSOR_RESIZE);
+                    return;
+                }
+            }
             break;
         case WLR_BUTTON_RELEASED:
             if (cursor_mode != WLC_CURSOR_NORMAL) {
-                wlr_xcursor_manager_set_cursor_image(cursor_mgr, "left_ptr", csr);    
-                cursor_mode = WLC_CURSOR_NORMAL;
+                end_grab();
                 return;
             } 
             break;
@@ -420,27 +958,90 @@ void cursor_button_notify(struct wl_listener *listener, void *data) {
             event->state);
 }
 
-void process_cursor_resize(uint32_t time) {
-    // b = border
-    double_t bx = csr->x - gcx;
-    double_t by = csr->y - gcy;
+// Configures the size requested by an interactive resize. Nothing is sent while
+// the client has not acked and committed the previous size, so a slow client
+// gets at most one configure per commit instead of one per motion event
+void flush_resize(struct wlc_client *c) {
+    if (!c->resize_pending || c->resize_serial) return;
+    c->resize_pending = false;
+    if (c->pw == c->geom.width && c->ph == c->geom.height) return;
+
+    c->geom.width = c->pw;
+    c->geom.height = c->ph;
+    c->resize_serial = client_configure(c, c->pw, c->ph);
+}
 
-    uint32_t new_left = gcx;
-    if (WLR_EDGE_TOP) {
-         
+void process_cursor_resize(uint32_t time) {
+    // b = border. Position of the dragged edges, local to the client's output
+    double_t bx = csr->x - gc->output->geom->x - gcx;
+    double_t by = csr->y - gc->output->geom->y - gcy;
+
+    int left = gbox.x;
+    int right = gbox.x + gbox.width;
+    int top = gbox.y;
+    int bottom = gbox.y + gbox.height;
+
+    if (gedges & WLR_EDGE_TOP) {
+        top = by < bottom ? by : bottom - 1;
+    } else if (gedges & WLR_EDGE_BOTTOM) {
+        bottom = by > top ? by : top + 1;
+    }
+    if (gedges & WLR_EDGE_LEFT) {
+        left = bx < right ? bx : right - 1;
+    } else if (gedges & WLR_EDGE_RIGHT) {
+        right = bx > left ? bx : left + 1;
     }
+
+    gc->pw = right - left;
+    gc->ph = bottom - top;
+    gc->resize_pending = true;
+    flush_resize(gc);
 }
 
 void process_cursor_move(uint32_t time) {
-    gc->geom.x = csr->x - gcx;
-    gc->geom.y = csr->y - gcy;
+    // Damage the old and new position only
+    damage_client(gc);
+    gc->geom.x = csr->x - gc->output->geom->x - gcx;
+    gc->geom.y = csr->y - gc->output->geom->y - gcy;
+    if (gc->type == WLC_X11) client_configure(gc, gc->geom.width, gc->geom.height);
+    update_client_outputs(gc);
+    invalidate_plans();
+    damage_client(gc);
 }
 
 // TODO
-void process_cursor_motion(uint32_t time) {
-    double sx, sy;
-    struct wlr_surface *surface = NULL;
-    struct wlc_client *c = find_client(csr->x, csr->y, &surface, &sx, &sy);
+void process_cursor_motion(uint32_t time, 
+        struct wlr_input_device *dev, 
+        double_t dx, 
+        double_t dy, 
+        double_t dx_unaccel, 
+        double_t dy_unaccel) {
+    // Raw motion for relative-pointer clients, before any constraint applies
+    wlr_relative_pointer_manager_v1_send_relative_motion(relative_pointer_manager, 
+            seat, 
+            (uint64_t) time * 1000, 
+            dx, 
+            dy, 
+            dx_unaccel, 
+            dy_unaccel);
+
+    if (active_constraint && cursor_mode == WLC_CURSOR_NORMAL) {
+        // A locked pointer stays where it is. Nothing under it can change, so
+        // there is no hit-test and no cursor image to update
+        if (active_constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) return;
+
+        // Stop a confined pointer at the edge of the region. The constrained
+        // surface has pointer focus, so its local position is known
+        double_t sx = seat->pointer_state.sx;
+        double_t sy = seat->pointer_state.sy;
+        double_t nx, ny;
+        if (wlr_region_confine(&active_constraint->region, sx, sy, sx + dx, sy + dy, &nx, &ny)) {
+            dx = nx - sx;
+            dy = ny - sy;
+        }
+    }
+
+    wlr_cursor_move(csr, dev, dx, dy);
 
     switch(cursor_mode) {
         case WLC_CURSOR_MOVE:
@@ -450,9 +1051,13 @@ void process_cursor_motion(uint32_t time) {
             process_cursor_resize(time);
             return;
     }
+
+    double sx, sy;
+    struct wlr_surface *surface = NULL;
+    struct wlc_client *c = find_client(csr->x, csr->y, &surface, &sx, &sy);
     // If no client under cursor, then use default cursor image
     if (!c) {
-        wlr_xcursor_manager_set_cursor_image(cursor_mgr, "left_ptr", csr);
+        set_cursor_image("left_ptr");
     }
 
     if (surface) {
@@ -463,49 +1068,121 @@ void process_cursor_motion(uint32_t time) {
         wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
         if (!focus_changed) {
             wlr_seat_pointer_notify_motion(seat, time, sx, sy);
+        } else {
+            activate_constraint(wlr_pointer_constraints_v1_constraint_for_surface(
+                        pointer_constraints, surface, seat));
         }
-        if (follow_mouse) focus_client(c, surface);
+        if (follow_mouse && (!c || !c->unmanaged)) focus_client(c, surface);
     } else {
         // Clear pointer focus so future pointer events are not sent to the last
         // focused client
         wlr_seat_pointer_clear_focus(seat);
+        activate_constraint(NULL);
     }
 }
 
 // Raised by cursor when pointer emits absolute motion event, from 0..1 on each
-// axis.
+// axis. Turned into a delta so constraints apply to it as well
 void cursor_motion_absolute_notify(struct wl_listener *listener, void *data) {
     struct wlr_event_pointer_motion_absolute *event = data;
-
-    wlr_cursor_warp_absolute(csr, event->device, event->x, event->y);
-    process_cursor_motion(event->time_msec);
+    record_event(WLC_INPUT_MOTION_ABSOLUTE, event);
+    idle_activity();
+
+    double_t lx, ly;
+    wlr_cursor_absolute_to_layout_coords(csr, event->device, event->x, event->y, &lx, &ly);
+    double_t dx = lx - csr->x;
+    double_t dy = ly - csr->y;
+    process_cursor_motion(event->time_msec, event->device, dx, dy, dx, dy);
 }
 
 // Raised when cursor emits relative pointer motion event (delta)
 void cursor_motion_notify(struct wl_listener *listener, void *data) {
     struct wlr_event_pointer_motion *event = data;
+    record_event(WLC_INPUT_MOTION, event);
+    idle_activity();
+
+    process_cursor_motion(event->time_msec, 
+            event->device, 
+            event->delta_x, 
+            event->delta_y, 
+            event->unaccel_dx, 
+            event->unaccel_dy);
+}
 
-    wlr_cursor_move(csr, event->device, event->delta_x, event->delta_y);
-    process_cursor_motion(event->time_msec);
+// Makes constraint the active pointer constraint, NULL for none. A locked
+// pointer that is released is put where the client hinted
+void activate_constraint(struct wlr_pointer_constraint_v1 *constraint) {
+    if (active_constraint == constraint) return;
+
+    struct wlr_pointer_constraint_v1 *prev = active_constraint;
+    active_constraint = constraint;
+    if (prev) {
+        if (prev->type == WLR_POINTER_CONSTRAINT_V1_LOCKED
+                && prev->current.cursor_hint.enabled
+                && seat->pointer_state.focused_surface == prev->surface) {
+            wlr_cursor_warp(csr, NULL, 
+                    csr->x - seat->pointer_state.sx + prev->current.cursor_hint.x,
+                    csr->y - seat->pointer_state.sy + prev->current.cursor_hint.y);
+        }
+        wlr_pointer_constraint_v1_send_deactivated(prev);
+    }
+    if (constraint) wlr_pointer_constraint_v1_send_activated(constraint);
+}
+
+// Raised when a client asks to lock or confine the pointer on one of its
+// surfaces. Takes effect while that surface has pointer focus
+void new_constraint_notify(struct wl_listener *listener, void *data) {
+    struct wlr_pointer_constraint_v1 *constraint = data;
+    struct wlc_constraint *wc = calloc(1, sizeof(struct wlc_constraint));
+    if (!wc) return;
+    wc->constraint = constraint;
+    listen(&wc->destroy, constraint_destroy_notify, &constraint->events.destroy);
+
+    if (seat->pointer_state.focused_surface == constraint->surface) {
+        activate_constraint(constraint);
+    }
+}
+
+void constraint_destroy_notify(struct wl_listener *listener, void *data) {
+    struct wlc_constraint *wc = wl_container_of(listener, wc, destroy);
+    if (active_constraint == wc->constraint) {
+        // Already going away, so only forget it
+        active_constraint = NULL;
+    }
+    wl_list_remove(&wc->destroy.link);
+    free(wc);
 }
 
 // Called when surface is unmapped
 void xdg_surface_unmap_notify(struct wl_listener *listener, void *data) {
     struct wlc_client *c = wl_container_of(listener, c, unmap);
+    toplevel_destroy(c);
+    if (c == gc) {
+        cursor_mode = WLC_CURSOR_NORMAL;
+        gc = NULL;
+    }
+    damage_client(c);
     c->output = NULL;
+    update_client_outputs(c);
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
     wl_list_remove(&c->llink);
     wl_list_remove(&c->flink);
     wl_list_remove(&c->zlink);
-
-    struct wlc_client *next;
-    wl_list_for_each(next, &fstack, flink) {
-        if (visible(next, foutput)) {
-            focus_client(next, next->xdg_surface->surface);
-            break;
-        }
+    // The wlr_surface of an X11 window only lives while it is mapped
+    if (c->type == WLC_X11) wl_list_remove(&c->commit.link);
+    if (c->unmanaged) {
+        if (foutput) wlr_output_damage_add_whole(foutput->wlr_damage);
+        return;
     }
 
-    if (layouts[foutput->layout].l) layouts[foutput->layout].l();
+    // Focus moves to the next visible client, or nowhere so the seat does not
+    // keep pointing at a surface that is no longer shown
+    struct wlc_client *next = fstack_top();
+    focus_client(next, next ? client_surface(next) : NULL);
+
+    schedule_arrange(foutput);
 }
 
 // Called when surface is destroyed and should never be shown again
@@ -515,37 +1192,357 @@ void xdg_surface_destroy_notify(struct wl_listener *listener, void *data) {
     wl_list_remove(&c->destroy.link);
     wl_list_remove(&c->map.link);
     wl_list_remove(&c->unmap.link);
+    wl_list_remove(&c->request_move.link);
+    wl_list_remove(&c->request_resize.link);
+    wl_list_remove(&c->set_title.link);
+    wl_list_remove(&c->set_app_id.link);
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) wl_list_remove(&c->request_configure.link);
+#endif
+    if (c->type == WLC_XDG) {
+        wl_list_remove(&c->commit.link);
+        wl_list_remove(&c->new_subsurface.link);
+        wl_list_remove(&c->new_popup.link);
+    }
+    // Subsurfaces can outlive the toplevel role of their parent
+    struct wlc_child *ch, *tmp;
+    wl_list_for_each_safe(ch, tmp, &c->children, link) {
+        child_destroy(ch);
+    }
     free(c);
 }
 
-// Called to notify when surface is mapped or ready to display
+// Called to notify when surface is mapped or ready to display. Used by both
+// xdg toplevels and X11 windows
 void xdg_surface_map_notify(struct wl_listener *listener, void *data) {
     struct wlc_client *c = wl_container_of(listener, c, map);
     c->output = foutput;
+    client_get_geometry(c, &c->geom);
+    c->cw = c->geom.width;
+    c->ch = c->geom.height;
+
+#ifdef XWAYLAND
+    if (c->type == WLC_X11) {
+        listen(&c->commit, xdg_surface_commit_notify, &c->xsurface->surface->events.commit);
+        if (foutput) {
+            c->geom.x -= foutput->geom->x;
+            c->geom.y -= foutput->geom->y;
+        }
+    }
+#endif
+
+    // Unmanaged windows (menus, tooltips) stay where X11 put them and never
+    // take focus
+    if (c->unmanaged) {
+        wl_list_init(&c->llink);
+        wl_list_init(&c->flink);
+        wl_list_insert(&zstack, &c->zlink);
+        damage_client(c);
+        update_client_outputs(c);
+        invalidate_plans();
+        toplevel_schedule();
+        idle_schedule();
+        return;
+    }
 
     // Add to c list
     wl_list_insert(&lstack, &c->llink);
     wl_list_insert(&fstack, &c->flink);
     wl_list_insert(&zstack, &c->zlink);
-    wlr_xdg_surface_get_geometry(c->xdg_surface, &c->geom);
-    focus_client(c, c->xdg_surface->surface);
-    if (layouts[foutput->layout].l) layouts[foutput->layout].l();
+    toplevel_create(c);
+    update_client_outputs(c);
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
+    focus_client(c, client_surface(c));
+    schedule_arrange(foutput);
+}
+
+// Adds the damage of a committed surface, translated to output coordinates
+static void damage_surface(struct wlr_surface *s, int x, int y, void *data) {
+    struct wlc_client *c = data;
+    struct wlr_output *o = c->output->wlr_output;
+
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    wlr_surface_get_effective_damage(s, &damage);
+    c->stats.damage_px += region_area(&damage);
+    if (c->output->powered_off) {
+        pixman_region32_fini(&damage);
+        return;
+    }
+    pixman_region32_translate(&damage, c->geom.x + x, c->geom.y + y);
+    wlr_region_scale(&damage, &damage, o->scale);
+    wlr_output_damage_add(c->output->wlr_damage, &damage);
+    pixman_region32_fini(&damage);
+}
+
+// Hashes the position of every surface in a client's tree
+static void surface_sig(struct wlr_surface *s, int x, int y, void *data) {
+    uint64_t *sig = data;
+    *sig = (*sig ^ (uintptr_t) s) * 1099511628211ull;
+    *sig = (*sig ^ (((uint64_t) (uint32_t) x << 32) | (uint32_t) y)) * 1099511628211ull;
+}
+
+// Called when the client commits a new surface state
+void xdg_surface_commit_notify(struct wl_listener *listener, void *data) {
+    struct wlc_client *c = wl_container_of(listener, c, commit);
+    struct wlr_surface *surface = client_surface(c);
+
+    // Load accounting. A commit made while the previous one has not been
+    // presented yet will never be seen
+    ++c->stats.commits;
+    if (c->stats.pending) ++c->stats.dropped;
+    ++c->stats.pending;
+    c->stats.buffer_width = surface->current.buffer_width;
+    c->stats.buffer_height = surface->current.buffer_height;
+
+    if (!c->output || !visible(c, c->output)) return;
+
+    // Subsurfaces and popups that moved, appeared or went away change the
+    // render plan
+    uint64_t sig = 14695981039346656037ull;
+    client_for_each_surface(c, surface_sig, &sig);
+    if (sig != c->plan_sig) invalidate_plans();
+    c->plan_sig = sig;
+
+    // Client acked and committed the last interactive resize. Send the next one
+    // if the cursor has moved since
+    if (c->resize_serial && c->type == WLC_XDG &&
+            (int32_t) (c->xdg_surface->configure_serial - c->resize_serial) >= 0) {
+        c->resize_serial = 0;
+        flush_resize(c);
+    }
+
+    // A resize from the top or left edge keeps the opposite edge in place up
+    // to the commit of its last size, which may come after the grab ended
+    uint32_t anchor_edges = c->anchor_edges;
+    if (!c->resize_serial && !c->resize_pending
+            && !(c == gc && cursor_mode == WLC_CURSOR_RESIZE)) {
+        c->anchor_edges = 0;
+    }
+
+    struct wlr_box g;
+    client_get_geometry(c, &g);
+    if (g.width == c->cw && g.height == c->ch) {
+        // Subsurfaces and popups damage on their own commits
+        damage_surface(surface, 0, 0, c);
+        return;
+    }
+
+    // Size changed. Damage the union of the old and new area, and the old and
+    // new buffer, which can be larger than the window geometry
+    struct wlr_box box = { c->geom.x, c->geom.y, c->cw, c->ch };
+    struct wlr_box old = { c->geom.x, c->geom.y, surface->previous.width, surface->previous.height };
+    damage_box(c->output, &old);
+    if (anchor_edges & WLR_EDGE_LEFT) c->geom.x = c->anchor.x + c->anchor.width - g.width;
+    if (anchor_edges & WLR_EDGE_TOP) c->geom.y = c->anchor.y + c->anchor.height - g.height;
+    c->cw = g.width;
+    c->ch = g.height;
+    update_client_outputs(c);
+    invalidate_plans();
+
+    int x2 = fmax(box.x + box.width, c->geom.x + c->cw);
+    int y2 = fmax(box.y + box.height, c->geom.y + c->ch);
+    box.x = fmin(box.x, c->geom.x);
+    box.y = fmin(box.y, c->geom.y);
+    box.width = x2 - box.x;
+    box.height = y2 - box.y;
+    damage_framed(c, &box);
+    damage_surface_box(surface, 0, 0, c);
+}
+
+static void child_find(struct wlr_surface *s, int x, int y, void *data) {
+    struct wlc_child *ch = data;
+    if (s != ch->surface) return;
+    ch->box.x = x;
+    ch->box.y = y;
+    ch->box.width = s->current.width;
+    ch->box.height = s->current.height;
+}
+
+// Damages the area the child was last drawn on, and forgets it
+static void child_damage_box(struct wlc_child *ch) {
+    struct wlc_client *c = ch->client;
+    if (ch->box.width && c->output && visible(c, c->output)) {
+        struct wlr_box box = ch->box;
+        box.x += c->geom.x;
+        box.y += c->geom.y;
+        damage_box(c->output, &box);
+    }
+    ch->box = (struct wlr_box) {0};
+}
+
+// Called when a subsurface or popup commits. Synchronized subsurfaces commit
+// together with their parent, desynchronized ones and popups on their own
+void child_commit_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, commit);
+    struct wlc_client *c = ch->client;
+    // Popup commits apply a new position after a configure, which the plans
+    // of hidden clients depend on as well
+    if (ch->popup) invalidate_plans();
+    if (!c->output || !visible(c, c->output)) return;
+
+    // Not found while unmapped
+    struct wlr_box last = ch->box;
+    ch->box = (struct wlr_box) {0};
+    client_for_each_surface(c, child_find, ch);
+    if (!wlr_box_empty(&ch->box) && ch->box.x == last.x && ch->box.y == last.y
+            && ch->box.width == last.width && ch->box.height == last.height) {
+        damage_surface(ch->surface, ch->box.x, ch->box.y, c);
+        return;
+    }
+
+    // Moved, resized, shown or hidden
+    struct wlr_box box = ch->box;
+    ch->box = last;
+    child_damage_box(ch);
+    ch->box = box;
+    if (!wlr_box_empty(&box)) damage_surface_box(ch->surface, box.x, box.y, c);
+    invalidate_plans();
+}
+
+// Sends enter and leave so a mapped child is on the outputs of its client, and
+// an unmapped one on none. Children mapped after their client entered an
+// output would otherwise never learn about it
+void child_update_outputs(struct wlc_child *ch) {
+    uint32_t mask = ch->mapped ? ch->client->outputs : 0;
+    uint32_t entered = mask & ~ch->outputs;
+    uint32_t left = ch->outputs & ~mask;
+    ch->outputs = mask;
+    if (!entered && !left) return;
+
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        if (o->bit & entered) wlr_surface_send_enter(ch->surface, o->wlr_output);
+        if (o->bit & left) wlr_surface_send_leave(ch->surface, o->wlr_output);
+    }
+}
+
+void child_map_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, map);
+    ch->mapped = true;
+    child_update_outputs(ch);
+}
+
+// Raised when a popup is moved by xdg_popup.reposition, which changes its
+// position without a commit of the toplevel
+void child_reposition_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, reposition);
+    child_damage_box(ch);
+    invalidate_plans();
+}
+
+void child_unmap_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, unmap);
+    child_damage_box(ch);
+    invalidate_plans();
+    ch->mapped = false;
+    child_update_outputs(ch);
+}
+
+void child_destroy_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, destroy);
+    child_damage_box(ch);
+    invalidate_plans();
+    child_destroy(ch);
+}
+
+void child_destroy(struct wlc_child *ch) {
+    wl_list_remove(&ch->link);
+    wl_list_remove(&ch->commit.link);
+    wl_list_remove(&ch->map.link);
+    wl_list_remove(&ch->unmap.link);
+    wl_list_remove(&ch->destroy.link);
+    wl_list_remove(&ch->new_subsurface.link);
+    if (ch->popup) {
+        wl_list_remove(&ch->new_popup.link);
+        wl_list_remove(&ch->reposition.link);
+    }
+    free(ch);
+}
+
+// Tracks surface, a subsurface or popup surface somewhere in c's tree. The
+// caller adds the map, unmap and destroy listeners of the role
+struct wlc_child *child_create(struct wlc_client *c, struct wlr_surface *surface) {
+    struct wlc_child *ch = calloc(1, sizeof(struct wlc_child));
+    if (!ch) return NULL;
+    ch->client = c;
+    ch->surface = surface;
+    wl_list_insert(&c->children, &ch->link);
+    listen(&ch->commit, child_commit_notify, &surface->events.commit);
+    listen(&ch->new_subsurface, child_new_subsurface_notify, &surface->events.new_subsurface);
+    return ch;
+}
+
+void subsurface_child(struct wlc_client *c, struct wlr_subsurface *subsurface) {
+    struct wlc_child *ch = child_create(c, subsurface->surface);
+    if (!ch) return;
+    listen(&ch->map, child_map_notify, &subsurface->events.map);
+    listen(&ch->unmap, child_unmap_notify, &subsurface->events.unmap);
+    listen(&ch->destroy, child_destroy_notify, &subsurface->events.destroy);
+}
+
+void popup_child(struct wlc_client *c, struct wlr_xdg_popup *popup) {
+    struct wlc_child *ch = child_create(c, popup->base->surface);
+    if (!ch) return;
+    ch->popup = true;
+    listen(&ch->map, child_map_notify, &popup->base->events.map);
+    listen(&ch->unmap, child_unmap_notify, &popup->base->events.unmap);
+    listen(&ch->destroy, child_destroy_notify, &popup->base->events.destroy);
+    listen(&ch->new_popup, child_new_popup_notify, &popup->base->events.new_popup);
+    listen(&ch->reposition, child_reposition_notify, &popup->events.reposition);
+}
+
+void child_new_subsurface_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, new_subsurface);
+    subsurface_child(ch->client, data);
+}
+
+void child_new_popup_notify(struct wl_listener *listener, void *data) {
+    struct wlc_child *ch = wl_container_of(listener, ch, new_popup);
+    popup_child(ch->client, data);
+}
+
+void client_new_subsurface_notify(struct wl_listener *listener, void *data) {
+    struct wlc_client *c = wl_container_of(listener, c, new_subsurface);
+    subsurface_child(c, data);
+}
+
+void client_new_popup_notify(struct wl_listener *listener, void *data) {
+    struct wlc_client *c = wl_container_of(listener, c, new_popup);
+    popup_child(c, data);
+}
+
+// Called when a client asks how its toplevel should be decorated
+void new_decoration_notify(struct wl_listener *listener, void *data) {
+    struct wlr_xdg_toplevel_decoration_v1 *decoration = data;
+    wlr_xdg_toplevel_decoration_v1_set_mode(decoration,
+            WLR_XDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
+}
+
+// Called when a client changes its title or app_id, shown by taskbars
+void client_name_notify(struct wl_listener *listener, void *data) {
+    toplevel_schedule();
 }
 
-/*
 // Called when client wants to begin interactive move
 void xdg_toplevel_request_move(struct wl_listener *listener, void *data) {
-    struct wlr_xdg_toplevel_move_event *event = data;
-    struct wlc_client *client = wl_container_of(listener, client, request_resize);
-
+    struct wlc_client *c = wl_container_of(listener, c, request_move);
+    if (c->output && cursor_mode == WLC_CURSOR_NORMAL) {
+        begin_grab(c, WLC_CURSOR_MOVE, 0);
+    }
 }
 
 // Called when client wants to being interactive resize
 void xdg_toplevel_request_resize(struct wl_listener *listener, void *data) {
     struct wlr_xdg_toplevel_resize_event *event = data;
-    struct wlc_client *client = wl_container_of(listener, client, request_resize);
+    struct wlc_client *c = wl_container_of(listener, c, request_resize);
+    if (c->output && cursor_mode == WLC_CURSOR_NORMAL) {
+        begin_grab(c, WLC_CURSOR_RESIZE, event->edges);
+    }
 }
-*/
+
 // Raised when new xdg surface is received
 void new_xdg_surface_notify(struct wl_listener *listener, void *data) {
     struct wlr_xdg_surface *xdg_surface = data;
@@ -553,6 +1550,8 @@ void new_xdg_surface_notify(struct wl_listener *listener, void *data) {
 
     // Allocate a client struct for the surface
     struct wlc_client *c = calloc(1, sizeof(struct wlc_client));
+    c->id = next_client_id++;
+    c->type = WLC_XDG;
     c->xdg_surface = xdg_surface;
 
     // See header file for description
@@ -570,158 +1569,659 @@ void new_xdg_surface_notify(struct wl_listener *listener, void *data) {
     listen(&c->map, xdg_surface_map_notify, &xdg_surface->events.map);
     listen(&c->unmap, xdg_surface_unmap_notify, &xdg_surface->events.unmap);
     listen(&c->destroy, xdg_surface_destroy_notify, &xdg_surface->events.destroy);
-    c->tag = foutput->tag;
+    listen(&c->commit, xdg_surface_commit_notify, &xdg_surface->surface->events.commit);
+    wl_list_init(&c->children);
+    listen(&c->new_subsurface, client_new_subsurface_notify, &xdg_surface->surface->events.new_subsurface);
+    listen(&c->new_popup, client_new_popup_notify, &xdg_surface->events.new_popup);
+    c->tag = foutput ? foutput->tag : 1;
 
     // Top level resize and move events
-    // struct wlr_xdg_toplevel *xdg_toplevel = xdg_surface->toplevel;
-    // client -> request_move = xdg_toplevel_request_move;
-    // wl_signal_add(&xdg_toplevel->events.request_move, &c->request_move);
-    // client -> request_resize = xdg_toplevel_request_resize;
-    // wl_signal_add(&xdg_toplevel->events.request_resize, &c->request_resize);
+    struct wlr_xdg_toplevel *xdg_toplevel = xdg_surface->toplevel;
+    listen(&c->request_move, xdg_toplevel_request_move, &xdg_toplevel->events.request_move);
+    listen(&c->request_resize, xdg_toplevel_request_resize, &xdg_toplevel->events.request_resize);
+    listen(&c->set_title, client_name_notify, &xdg_toplevel->events.set_title);
+    listen(&c->set_app_id, client_name_notify, &xdg_toplevel->events.set_app_id);
+
+}
+
+// Returns the resident set size of process pid in KiB
+static long rss_kib(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long size, resident = -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double_t ms_since(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+#ifdef XWAYLAND
+// Called when an X11 window asks for a new geometry. Only floating and
+// unmanaged windows get what they ask for, tiled ones are told their slot
+void x11_request_configure(struct wl_listener *listener, void *data) {
+    struct wlr_xwayland_surface_configure_event *event = data;
+    struct wlc_client *c = wl_container_of(listener, c, request_configure);
+    if (!c->output || c->unmanaged || !get_layout(c->output->layout)->l) {
+        wlr_xwayland_surface_configure(c->xsurface, 
+                event->x, 
+                event->y, 
+                event->width, 
+                event->height);
+        return;
+    }
+    client_configure(c, c->geom.width, c->geom.height);
+}
+
+void x11_request_resize(struct wl_listener *listener, void *data) {
+    struct wlr_xwayland_resize_event *event = data;
+    struct wlc_client *c = wl_container_of(listener, c, request_resize);
+    if (c->output && cursor_mode == WLC_CURSOR_NORMAL) {
+        begin_grab(c, WLC_CURSOR_RESIZE, event->edges);
+    }
+}
+
+// Raised when a new X11 window is created
+void new_xwayland_surface_notify(struct wl_listener *listener, void *data) {
+    struct wlr_xwayland_surface *xsurface = data;
+
+    struct wlc_client *c = calloc(1, sizeof(struct wlc_client));
+    c->id = next_client_id++;
+    c->type = WLC_X11;
+    c->xsurface = xsurface;
+    c->unmanaged = xsurface->override_redirect;
+    c->tag = foutput ? foutput->tag : 1;
+    wl_list_init(&c->children);
+
+    // The commit listener is added on map, X11 windows only get a wlr_surface
+    // while they are mapped
+    listen(&c->map, xdg_surface_map_notify, &xsurface->events.map);
+    listen(&c->unmap, xdg_surface_unmap_notify, &xsurface->events.unmap);
+    listen(&c->destroy, xdg_surface_destroy_notify, &xsurface->events.destroy);
+    listen(&c->request_configure, x11_request_configure, &xsurface->events.request_configure);
+    listen(&c->request_move, xdg_toplevel_request_move, &xsurface->events.request_move);
+    listen(&c->request_resize, x11_request_resize, &xsurface->events.request_resize);
+    listen(&c->set_title, client_name_notify, &xsurface->events.set_title);
+    listen(&c->set_app_id, client_name_notify, &xsurface->events.set_class);
+}
+
+// Raised once the lazily started X server accepts clients
+void xwayland_ready_notify(struct wl_listener *listener, void *data) {
+    wlr_xwayland_set_seat(xwayland, seat);
 
+    // X11 windows get the default cursor at scale 1, which may not be loaded
+    // for any output
+    wlr_xcursor_manager_load(cursor_mgr, 1);
+    struct wlr_xcursor *xcursor = wlr_xcursor_manager_get_xcursor(cursor_mgr, "left_ptr", 1);
+    if (xcursor) {
+        struct wlr_xcursor_image *image = xcursor->images[0];
+        wlr_xwayland_set_cursor(xwayland, 
+                image->buffer, 
+                image->width * 4, 
+                image->width,
+                image->height, 
+                image->hotspot_x, 
+                image->hotspot_y);
+    }
+
+    INFO("Xwayland active after %.1f ms: wlc %ld KiB, Xwayland %ld KiB",
+            ms_since(&start_time),
+            rss_kib(getpid()), 
+            xwayland->server ? rss_kib(xwayland->server->pid) : -1);
+}
+#endif
+
+// Scales the provided box with a provided scale factor. Edges are rounded
+// rather than the size, so boxes that touch still touch at fractional scales
+void scale_box(struct wlr_box *box, float scale) {
+    int x2 = round((box->x + box->width) * scale);
+    int y2 = round((box->y + box->height) * scale);
+    box->x = round(box->x * scale);
+    box->y = round(box->y * scale);
+    box->width = x2 - box->x;
+    box->height = y2 - box->y;
 }
 
-// Scales the provided box with a provided scale factor
-void scale_box(struct wlr_box *box, uint32_t scale) {
-    box->x *= scale;
-    box->y *= scale;
-    box->width *= scale;
-    box->height *= scale;
+// Marks the render plans of all outputs stale
+void invalidate_plans() {
+    ++plan_serial;
 }
 
-// Called for every surface that needs to be rendered
-void render_surface(struct wlr_surface *s, 
+// Adds a surface to the render plan of the output in data
+void plan_surface(struct wlr_surface *s, 
         int x, 
         int y, 
         void *data) {
     struct render_data *rdata = data;
     struct wlc_client *c = rdata->client;
-    struct wlr_output *o = rdata->output;
-
-    // Obtain a wlr_texture, which is a GPU resource.wlroots handles this
-    struct wlr_texture *texture = wlr_surface_get_texture(s);
-    if (texture == NULL) {
-        ERROR("Could not obtain wlr_texture");
-        return;
+    struct wlr_output *wo = rdata->output;
+    struct wlc_output *o = wo->data;
+
+    if (o->plan_len == o->plan_cap) {
+        uint32_t cap = o->plan_cap ? o->plan_cap * 2 : 16;
+        struct wlc_plan_entry *plan = realloc(o->plan, cap * sizeof(*plan));
+        if (!plan) return;
+        o->plan = plan;
+        o->plan_cap = cap;
     }
 
-    // View has output layout coordinates. Need to translate to output local
-    // coordinates (ex. layout coordinates: 2000, 100, two displays 1920x1080,
-    // then local coordinates = 2000-1920,100)
-    double_t ox = 0, oy = 0;
-    wlr_output_layout_output_coords(output_layout, 
-            o, 
-            &ox,
-            &oy);
-
-    // Apply scale factor for HiDPI outputs
-    struct wlr_box box = {
-        .x = ox + c->geom.x + x,
-        .y = oy + c->geom.y + y,
+    // Client geometry is already local to the output. Apply scale factor for
+    // HiDPI outputs. s->current.width and height are already the viewport
+    // destination size when the client uses one
+    struct wlc_plan_entry *e = &o->plan[o->plan_len++];
+    e->surface = s;
+    e->client = c;
+    e->box = (struct wlr_box) {
+        .x = c->geom.x + x,
+        .y = c->geom.y + y,
         .width = s->current.width,
         .height = s->current.height,
     };
-    scale_box(&box, o->scale);
+    scale_box(&e->box, wo->scale);
 
     // Create a matrix for model-view-projection matrix
-    float matrix[9];
     enum wl_output_transform transform = wlr_output_transform_invert(s->current.transform);
-    wlr_matrix_project_box(matrix, 
-            &box, 
+    wlr_matrix_project_box(e->matrix, 
+            &e->box, 
             transform, 
             0,
-            o->transform_matrix);
+            wo->transform_matrix);
+}
+
+// Rebuilds the render plan of o: every surface of the clients shown on o,
+// back to front, with its box and matrix in output buffer coordinates
+void build_plan(struct wlc_output *o) {
+    o->plan_len = 0;
+
+    // Client list is ordered from front to back, so iterate over it backwards
+    struct wlc_client *c;
+    wl_list_for_each_reverse(c, &zstack, zlink) {
+        // Do not render client if it is not mapped
+        if (!visible(c, o)) continue;
+
+        struct render_data rdata = {
+            .output = o->wlr_output,
+            .client = c,
+        };
+        client_for_each_surface(c, plan_surface, &rdata);
+    }
+    plan_borders(o);
+    o->plan_serial = plan_serial;
+    ++o->plan_builds;
+}
+
+// Adds the border rectangles of the clients in the render plan of o. Parts of
+// a border covered by any surface above it, including the client's own popups,
+// are left out, so all borders can be drawn in one batch after the surfaces
+void plan_borders(struct wlc_output *o) {
+    o->borders_len = 0;
+    if (!border_width) return;
+
+    float scale = o->wlr_output->scale;
+
+    pixman_region32_t above;
+    pixman_region32_init(&above);
+
+    // Plan entries of a client are contiguous, walk the clients front to back
+    uint32_t end = o->plan_len;
+    while (end > 0) {
+        struct wlc_client *c = o->plan[end - 1].client;
+        uint32_t start = end - 1;
+        while (start > 0 && o->plan[start - 1].client == c) --start;
+
+        pixman_region32_t cover;
+        pixman_region32_init(&cover);
+        for (uint32_t i = start; i < end; ++i) {
+            struct wlr_box *b = &o->plan[i].box;
+            pixman_region32_union_rect(&cover, &cover, b->x, b->y, b->width, b->height);
+        }
+
+        if (!c->unmanaged) {
+            struct wlr_box inner = { c->geom.x, c->geom.y, c->cw, c->ch };
+            int bw = border_width;
+            struct wlr_box outer = {
+                inner.x - bw,
+                inner.y - bw,
+                inner.width + 2 * bw,
+                inner.height + 2 * bw,
+            };
+            scale_box(&inner, scale);
+            scale_box(&outer, scale);
+
+            pixman_region32_t border;
+            pixman_region32_init_rect(&border, outer.x, outer.y, outer.width, outer.height);
+            pixman_region32_t hole;
+            pixman_region32_init_rect(&hole, inner.x, inner.y, inner.width, inner.height);
+            pixman_region32_union(&hole, &hole, &cover);
+            pixman_region32_union(&hole, &hole, &above);
+            pixman_region32_subtract(&border, &border, &hole);
+            pixman_region32_fini(&hole);
+
+            int nrects;
+            pixman_box32_t *rects = pixman_region32_rectangles(&border, &nrects);
+            for (int i = 0; i < nrects; ++i) {
+                if (o->borders_len == o->borders_cap) {
+                    uint32_t cap = o->borders_cap ? o->borders_cap * 2 : 16;
+                    struct wlc_border_rect *b = realloc(o->borders, cap * sizeof(*b));
+                    if (!b) break;
+                    o->borders = b;
+                    o->borders_cap = cap;
+                }
+                o->borders[o->borders_len++] = (struct wlc_border_rect) {
+                    .box = {
+                        rects[i].x1,
+                        rects[i].y1,
+                        rects[i].x2 - rects[i].x1,
+                        rects[i].y2 - rects[i].y1,
+                    },
+                    .client = c,
+                };
+            }
+            pixman_region32_fini(&border);
+            pixman_region32_union_rect(&above, &above,
+                    outer.x, outer.y, outer.width, outer.height);
+        }
 
-    // Takes matrix, texture, alpha, and renderer and performs rendering
-    wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
+        pixman_region32_union(&above, &above, &cover);
+        pixman_region32_fini(&cover);
+        end = start;
+    }
+    pixman_region32_fini(&above);
+}
+
+// Draws the damaged part of all borders of o as one batch: one scissor per
+// damaged rectangle and the borders inside it. Focus changes only damage the
+// borders, the plan stays valid
+void render_borders(struct wlc_output *o, pixman_region32_t *damage) {
+    if (o->borders_len == 0) return;
+
+    struct wlr_surface *focused = seat->keyboard_state.focused_surface;
+
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(damage, &nrects);
+    for (int i = 0; i < nrects; ++i) {
+        scissor_output(o->wlr_output, &rects[i]);
+        for (uint32_t j = 0; j < o->borders_len; ++j) {
+            struct wlr_box *b = &o->borders[j].box;
+            if (b->x >= rects[i].x2 || b->x + b->width <= rects[i].x1
+                    || b->y >= rects[i].y2 || b->y + b->height <= rects[i].y1) {
+                continue;
+            }
+            struct wlc_client *c = o->borders[j].client;
+            const float *color = client_surface(c) == focused ? border_focus : border_normal;
+            wlr_render_rect(renderer, b, color, o->wlr_output->transform_matrix);
+        }
+    }
+}
+
+// Draws the damaged part of every surface in the render plan of o. Only the
+// textures are looked up again, they change with every buffer the client
+// attaches
+void render_plan(struct wlc_output *o, pixman_region32_t *damage) {
+    struct wlc_client *last = NULL;
+    for (uint32_t i = 0; i < o->plan_len; ++i) {
+        struct wlc_plan_entry *e = &o->plan[i];
+        struct wlc_client *c = e->client;
+        // Frame done is only driven by outputs the client is on
+        bool on_output = c->outputs & o->bit;
+
+        if (c != last) {
+            ++o->composited;
+            // Latest commit of the client is now on screen
+            if (c->stats.pending && on_output) {
+                ++c->stats.frames;
+                c->stats.pending = 0;
+            }
+            last = c;
+        }
+
+        // Obtain a wlr_texture, which is a GPU resource.wlroots handles this
+        struct wlr_texture *texture = wlr_surface_get_texture(e->surface);
+        if (texture == NULL) {
+            ERROR("Could not obtain wlr_texture");
+            continue;
+        }
+
+        // Only the damaged part of the surface is redrawn
+        pixman_region32_t clip;
+        pixman_region32_init_rect(&clip, e->box.x, e->box.y, e->box.width, e->box.height);
+        pixman_region32_intersect(&clip, &clip, damage);
+        if (pixman_region32_not_empty(&clip)) {
+            // Part of the buffer that is shown, in buffer coordinates. Clients
+            // using wp_viewporter may crop their buffer, and the crop of a
+            // transformed buffer is transformed with it
+            struct wlr_fbox src;
+            wlr_surface_get_buffer_source_box(e->surface, &src);
+            int nrects;
+            pixman_box32_t *rects = pixman_region32_rectangles(&clip, &nrects);
+            for (int j = 0; j < nrects; ++j) {
+                scissor_output(o->wlr_output, &rects[j]);
+                wlr_render_subtexture_with_matrix(renderer, texture, &src, e->matrix, 1);
+            }
+            o->rendered_px += region_area(&clip);
+        }
+        pixman_region32_fini(&clip);
+
+        // Let client know frame is done rendering and can now prepare new
+        // frame if needed
+        if (on_output) wlr_surface_send_frame_done(e->surface, &o->last_frame);
+    }
+}
+
+static void surface_watch_commit(struct wl_listener *listener, void *data) {
+    struct wlc_surface_watch *w = wl_container_of(listener, w, commit);
+    struct wlr_surface *s = data;
+    if (s->current.width == w->width && s->current.height == w->height
+            && s->current.transform == w->transform) {
+        return;
+    }
+    w->width = s->current.width;
+    w->height = s->current.height;
+    w->transform = s->current.transform;
+    invalidate_plans();
+}
+
+static void surface_watch_destroy(struct wl_listener *listener, void *data) {
+    struct wlc_surface_watch *w = wl_container_of(listener, w, destroy);
+    wl_list_remove(&w->commit.link);
+    wl_list_remove(&w->destroy.link);
+    free(w);
+    invalidate_plans();
+}
+
+// Watches every surface, so render plans never keep a destroyed surface and
+// are rebuilt when a surface is resized or transformed, even by a commit that
+// does not go through its client's root surface
+void new_surface_notify(struct wl_listener *listener, void *data) {
+    struct wlr_surface *s = data;
+    struct wlc_surface_watch *w = calloc(1, sizeof(struct wlc_surface_watch));
+    if (!w) return;
+    listen(&w->commit, surface_watch_commit, &s->events.commit);
+    listen(&w->destroy, surface_watch_destroy, &s->events.destroy);
+}
+
+void layout_change_notify(struct wl_listener *listener, void *data) {
+    invalidate_plans();
+}
+
+// Restricts rendering to rect, given in output buffer coordinates
+void scissor_output(struct wlr_output *o, pixman_box32_t *rect) {
+    struct wlr_box box = {
+        .x = rect->x1,
+        .y = rect->y1,
+        .width = rect->x2 - rect->x1,
+        .height = rect->y2 - rect->y1,
+    };
 
-    // Let client know frame is done rendering and can now prepare new frame if
-    // needed
-    wlr_surface_send_frame_done(s, rdata->when);
+    int ow, oh;
+    wlr_output_transformed_resolution(o, &ow, &oh);
+    enum wl_output_transform transform = wlr_output_transform_invert(o->transform);
+    wlr_box_transform(&box, &box, transform, ow, oh);
+    wlr_renderer_scissor(renderer, &box);
 }
 
-void output_commit_notify(struct wl_listener *l, void* data) {
-    struct wlr_surface *surface = data;
-    pixman_region32_t *damage;
-    wlr_surface_get_effective_damage(surface, damage);
+static void frame_done_surface(struct wlr_surface *s, int x, int y, void *data) {
+    wlr_surface_send_frame_done(s, data);
+}
+
+// Lets the clients shown on the output know that they can prepare a new frame
+// even though nothing was redrawn
+void send_frame_done(struct wlc_output *o, struct timespec *when) {
+    struct wlc_client *c;
+    wl_list_for_each(c, &zstack, zlink) {
+        if (!visible(c, o) || !(c->outputs & o->bit)) continue;
+        client_for_each_surface(c, frame_done_surface, when);
+    }
 }
 
 // Called when output is ready to display a frame (usually at output's refresh
-// rate)
+// rate) and something on it has been damaged
 void output_frame_notify(struct wl_listener *listener, void *data) {
     struct wlc_output *o = wl_container_of(listener, o, frame);
+    // Damage added before the output powered down can still schedule a frame
+    if (o->powered_off) return;
 
     clock_gettime(CLOCK_MONOTONIC, &o->last_frame);
 
     // Makes OpenGL context current
-    if (!wlr_output_attach_render(o->wlr_output, NULL)) {
+    bool needs_frame;
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    if (!wlr_output_damage_attach_render(o->wlr_damage, &needs_frame, &damage)) {
         ERROR("Failed to attach renderer\n");
+        pixman_region32_fini(&damage);
+        return;
+    }
+
+    if (!needs_frame) {
+        wlr_output_rollback(o->wlr_output);
+        pixman_region32_fini(&damage);
+        send_frame_done(o, &o->last_frame);
         return;
     }
 
+    // Damage statistics leave out the overlay, which damages itself every frame
+    struct wlr_box hbox;
+    hud_box(&hbox);
+    pixman_region32_t stat;
+    pixman_region32_init(&stat);
+    pixman_region32_copy(&stat, &damage);
+    if (o->hud_shown) {
+        pixman_region32_t h;
+        pixman_region32_init_rect(&h, hbox.x, hbox.y, hbox.width, hbox.height);
+        pixman_region32_subtract(&stat, &stat, &h);
+        pixman_region32_fini(&h);
+    }
+    o->damage_px = region_area(&stat);
+    pixman_region32_fini(&stat);
+
     int width, height;
     wlr_output_effective_resolution(o->wlr_output, &width, &height);
 
+    o->rendered_px = 0;
+    o->composited = 0;
     wlr_renderer_begin(renderer, width, height);
     float color[4] = {0.3, 0.3, 0.3, 1.0};
-    wlr_renderer_clear(renderer, color);
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(&damage, &nrects);
+    for (int i = 0; i < nrects; ++i) {
+        scissor_output(o->wlr_output, &rects[i]);
+        wlr_renderer_clear(renderer, color);
+    }
 
-    // Renders each client in client list. List is ordered from front to back,
-    // so iterate over list backwards
-    struct wlc_client *c;
-    wl_list_for_each_reverse(c, &zstack, zlink) {
-        // Do not render client if it is not mapped
-        if (!visible(c, foutput)) continue;
+    // The plan is reused until placement, stacking or the surface trees change
+    if (o->plan_serial != plan_serial) build_plan(o);
+    render_plan(o, &damage);
+    render_borders(o, &damage);
+    wlr_renderer_scissor(renderer, NULL);
+    wlr_output_render_software_cursors(o->wlr_output, &damage); // Needed for software cursor (no GPU)
 
-        struct render_data rdata = {
-            .output = o->wlr_output,
-            .client = c,
-            .renderer = renderer,
-            .when = &o->last_frame,
-        };
-        wlr_xdg_surface_for_each_surface(c->xdg_surface, render_surface, &rdata);
-    }
-    wlr_output_render_software_cursors(o->wlr_output, NULL); // Needed for software cursor (no GPU)
+    uint64_t ns = ms_since(&o->last_frame) * 1e6;
+    if (dump_enabled()) dump_frame(o, renderer, ns);
+    ++o->frames;
+
+    // Overlay is drawn last and left out of the recorded render time
+    hud_record(o, ns);
+    o->hud_shown = hud_enabled;
+    if (hud_enabled) hud_render(o, renderer);
 
     // Conclude rendering and swap buffers
     wlr_renderer_end(renderer);
-    wlr_output_commit(o->wlr_output);
+
+    // Tell the backend which part of the buffer changed
+    int tw, th;
+    wlr_output_transformed_resolution(o->wlr_output, &tw, &th);
+    pixman_region32_t frame_damage;
+    pixman_region32_init(&frame_damage);
+    enum wl_output_transform transform = wlr_output_transform_invert(o->wlr_output->transform);
+    wlr_region_transform(&frame_damage, &o->wlr_damage->current, transform, tw, th);
+    wlr_output_set_damage(o->wlr_output, &frame_damage);
+    pixman_region32_fini(&frame_damage);
+
+    if (wlr_output_commit(o->wlr_output)) mirror_damage(o);
+    pixman_region32_fini(&damage);
+
+    // Keep the overlay values live
+    if (hud_enabled) wlr_output_damage_add_box(o->wlr_damage, &hbox);
 }
 
 // Raised when output device is removed. Removes all lists and frees memory
 void output_destroy_notify(struct wl_listener *listener, void *data) {
     struct wlc_output *o = wl_container_of(listener, o, destroy);
+    INFO("Layout cache for %s: %lu hits, %lu misses",
+            o->wlr_output->name, o->cache_hits, o->cache_misses);
+    INFO("Arranges for %s: %lu run, %lu coalesced",
+            o->wlr_output->name, o->arranges, o->arrange_requests - o->arranges);
+    INFO("Render plan for %s: %lu builds over %lu frames",
+            o->wlr_output->name, o->plan_builds, o->frames);
+    if (o->mirror_of) {
+        INFO("Mirror %s: %lu frames copied from %s",
+                o->wlr_output->name, o->mirror_frames, o->mirror_of);
+    }
     wl_list_remove(&o->link);
     wl_list_remove(&o->destroy.link);
     wl_list_remove(&o->frame.link);
+
+    // Clients move to the first output left, or to none until an output comes
+    // back. Outputs powered down while idle count, they come back with input.
+    // A grab on the output ends here
+    struct wlc_output *next = NULL;
+    struct wlc_output *e;
+    wl_list_for_each(e, &outputs, link) {
+        if (e->wlr_output->enabled || e->powered_off) {
+            next = e;
+            break;
+        }
+    }
+    if (foutput == o) foutput = next;
+    if (gc && gc->output == o) end_grab();
+
+    // The wl_output goes away with the output, so clients only forget it
+    struct wlc_client *c;
+    wl_list_for_each(c, &zstack, zlink) {
+        c->outputs &= ~o->bit;
+        if (c->output == o) c->output = next;
+    }
+    output_bits &= ~o->bit;
+    if (next) {
+        schedule_arrange(next);
+        wlr_output_damage_add_whole(next->wlr_damage);
+    }
+    update_all_client_outputs();
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
+    update_output_manager();
+    toplevel_output_destroyed(o);
+
+    for (int i = 0; i < LAYOUT_CACHE_SIZE; ++i) {
+        free(o->cache[i].slots);
+    }
+    free(o->plan);
+    free(o->borders);
     free(o);
 }
 
+// Mode used for a new output. With prefer_refresh, the fastest mode at the
+// resolution of the preferred mode
+struct wlr_output_mode *choose_mode(struct wlr_output *wo) {
+    struct wlr_output_mode *best = wlr_output_preferred_mode(wo);
+    if (!prefer_refresh || !best) return best;
+
+    struct wlr_output_mode *m;
+    wl_list_for_each(m, &wo->modes, link) {
+        if (m->width == best->width && m->height == best->height
+                && m->refresh > best->refresh) {
+            best = m;
+        }
+    }
+    return best;
+}
+
+// Enables a new output with the scale and mode from config.h. Each candidate
+// mode goes through a test-only commit before the real one
+bool configure_output(struct wlr_output *wo, const struct wlc_output_rule *rule) {
+    wlr_output_enable(wo, true);
+    if (rule) wlr_output_set_scale(wo, rule->scale);
+
+    // Headless and nested outputs have no modes and take any size
+    if (wl_list_empty(&wo->modes)) {
+        if (rule && rule->width) {
+            wlr_output_set_custom_mode(wo, rule->width, rule->height, rule->refresh);
+        }
+        if (wlr_output_test(wo)) return wlr_output_commit(wo);
+        wlr_output_rollback(wo);
+        return false;
+    }
+
+    struct wlr_output_mode *mode = choose_mode(wo);
+    wlr_output_set_mode(wo, mode);
+    if (wlr_output_test(wo)) return wlr_output_commit(wo);
+
+    // Fall back to the first mode the output accepts
+    struct wlr_output_mode *m;
+    wl_list_for_each(m, &wo->modes, link) {
+        if (m == mode) continue;
+        wlr_output_set_mode(wo, m);
+        if (wlr_output_test(wo)) return wlr_output_commit(wo);
+    }
+    wlr_output_rollback(wo);
+    return false;
+}
+
 // Raised by backend when new output becomes available
 void new_output_notify(struct wl_listener *listener, void *data) {
     struct wlr_output *wlr_output = data;
 
-    // Set the mode of the monityr (tuple - width, height, refresh rate). For
-    // now, this is set to the output's preferred mode
-    if (!wl_list_empty(&wlr_output->modes)) {
-        struct wlr_output_mode *mode = wlr_output_preferred_mode(wlr_output);
-        wlr_output_set_mode(wlr_output, mode);
-        wlr_output_enable(wlr_output, true);
-        if (wlr_output_commit(wlr_output)) {
-            return;
+    // Per output scale and mode from config.h. Fractional scales are rendered
+    // exactly, clients that use wp_viewporter can supply buffers of the exact
+    // size
+    const struct wlc_output_rule *rule = NULL;
+    for (size_t i = 0; i < sizeof(output_rules) / sizeof(output_rules[0]); ++i) {
+        if (!strcmp(output_rules[i].name, wlr_output->name)) {
+            rule = &output_rules[i];
+            break;
         }
     }
+    if (!configure_output(wlr_output, rule)) {
+        ERROR("No usable mode for %s, leaving it off", wlr_output->name);
+        return;
+    }
 
     struct wlc_output *o = calloc(1, sizeof(struct wlc_output));
     o->wlr_output = wlr_output;
+    wlr_output->data = o;
+
+    // Mirrors only copy their source's frames and stay out of the layout
+    for (size_t i = 0; i < sizeof(mirror_rules) / sizeof(mirror_rules[0]); ++i) {
+        if (strcmp(mirror_rules[i].name, wlr_output->name)) continue;
+        o->mirror_of = mirror_rules[i].source;
+        o->mirror_dirty = true;
+        listen(&o->frame, mirror_frame_notify, &wlr_output->events.frame);
+        listen(&o->destroy, output_destroy_notify, &wlr_output->events.destroy);
+        wl_list_insert(&mirrors, &o->link);
+        wlr_output_schedule_frame(wlr_output);
+        INFO("Mirroring %s on %s", o->mirror_of, wlr_output->name);
+        update_output_manager();
+        return;
+    }
 
     // o->frame.notify = output_frame_notify;
     // wl_signal_add(&wlr_output->events.frame, &o->frame);
     // o->destroy.notify = output_destroy_notify;
     // wl_signal_add(&wlr_output->events.destroy, &o->destroy);
-    listen(&o->frame, output_frame_notify, &wlr_output->events.frame);
+    // The destroy listener goes first. The output damage and the layout free
+    // their state on the same signal, and output_destroy_notify still needs
+    // both
     listen(&o->destroy, output_destroy_notify, &wlr_output->events.destroy);
-    listen(&o->commit, output_commit_notify, &wlr_output->events.commit);
+    o->wlr_damage = wlr_output_damage_create(wlr_output);
+    listen(&o->frame, output_frame_notify, &o->wlr_damage->events.frame);
 
     o->n_master = 1;
     o->f_master = 0.55;
@@ -732,8 +2232,172 @@ void new_output_notify(struct wl_listener *listener, void *data) {
     wlr_output_layout_add_auto(output_layout, wlr_output);
 
     o->geom = wlr_output_layout_get_box(output_layout, o->wlr_output);
-    wlr_output->data = o;
     wl_list_insert(&outputs, &o->link);
+
+    // Bit used to track which clients are on this output
+    o->bit = ~output_bits & -~output_bits;
+    output_bits |= o->bit;
+    cursor_scales_changed = true;
+
+    // First output after running without any. Clients left without an output
+    // come back on it
+    if (!foutput) {
+        foutput = o;
+        struct wlc_client *c;
+        wl_list_for_each(c, &zstack, zlink) {
+            if (!c->output) c->output = o;
+        }
+        schedule_arrange(o);
+    }
+    update_all_client_outputs();
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
+    update_output_manager();
+}
+
+static void add_head(struct wlr_output_configuration_v1 *config, struct wlc_output *o) {
+    struct wlr_output_configuration_head_v1 *head =
+        wlr_output_configuration_head_v1_create(config, o->wlr_output);
+    if (!head) return;
+    struct wlr_box *box = wlr_output_layout_get_box(output_layout, o->wlr_output);
+    if (box) {
+        head->state.x = box->x;
+        head->state.y = box->y;
+    }
+}
+
+// Publishes the current state of all outputs to output management clients
+void update_output_manager() {
+    if (!output_manager) return;
+    struct wlr_output_configuration_v1 *config = wlr_output_configuration_v1_create();
+    if (!config) return;
+
+    struct wlc_output *o;
+    wl_list_for_each(o, &outputs, link) {
+        add_head(config, o);
+    }
+    wl_list_for_each(o, &mirrors, link) {
+        add_head(config, o);
+    }
+    wlr_output_manager_v1_set_configuration(output_manager, config);
+}
+
+// Puts an output where a committed configuration placed it
+void place_output(struct wlc_output *o, struct wlr_output_configuration_head_v1 *head) {
+    // An explicit configuration wins over idle power-down
+    o->powered_off = false;
+
+    if (o->mirror_of) {
+        o->mirror_dirty = true;
+        if (head->state.enabled) wlr_output_schedule_frame(o->wlr_output);
+        return;
+    }
+
+    if (head->state.enabled) {
+        cursor_scales_changed = true;
+        wlr_output_layout_add(output_layout, o->wlr_output, head->state.x, head->state.y);
+        o->geom = wlr_output_layout_get_box(output_layout, o->wlr_output);
+        if (!foutput) foutput = o;
+        schedule_arrange(o);
+        wlr_output_damage_add_whole(o->wlr_damage);
+        return;
+    }
+
+    // The layout frees its box, geom keeps the last one. Clients stay on the
+    // output and come back with it
+    o->disabled_geom = *o->geom;
+    o->geom = &o->disabled_geom;
+    wlr_output_layout_remove(output_layout, o->wlr_output);
+    if (foutput == o) {
+        foutput = NULL;
+        struct wlc_output *e;
+        wl_list_for_each(e, &outputs, link) {
+            if (e->wlr_output->enabled || e->powered_off) {
+                foutput = e;
+                break;
+            }
+        }
+    }
+}
+
+// Applies or only tests a configuration from an output management client.
+// Every head passes a test-only commit before any head is committed
+void apply_output_config(struct wlr_output_configuration_v1 *config, bool test_only) {
+    struct wlr_output_configuration_head_v1 *head;
+    bool ok = true;
+    wl_list_for_each(head, &config->heads, link) {
+        struct wlr_output *wo = head->state.output;
+        wlr_output_enable(wo, head->state.enabled);
+        if (head->state.enabled) {
+            if (head->state.mode) {
+                wlr_output_set_mode(wo, head->state.mode);
+            } else {
+                wlr_output_set_custom_mode(wo,
+                        head->state.custom_mode.width,
+                        head->state.custom_mode.height,
+                        head->state.custom_mode.refresh);
+            }
+            wlr_output_set_scale(wo, head->state.scale);
+            wlr_output_set_transform(wo, head->state.transform);
+        }
+        if (!wlr_output_test(wo)) {
+            ERROR("Output configuration rejected for %s", wo->name);
+            ok = false;
+        }
+    }
+
+    wl_list_for_each(head, &config->heads, link) {
+        struct wlr_output *wo = head->state.output;
+        if (!ok || test_only) {
+            wlr_output_rollback(wo);
+            continue;
+        }
+        // Can still fail after a good test, earlier heads stay applied
+        if (!wlr_output_commit(wo)) {
+            ERROR("Output configuration failed for %s", wo->name);
+            ok = false;
+            continue;
+        }
+        place_output(wo->data, head);
+    }
+
+    if (ok) wlr_output_configuration_v1_send_succeeded(config);
+    else wlr_output_configuration_v1_send_failed(config);
+    wlr_output_configuration_v1_destroy(config);
+
+    if (test_only) return;
+    update_all_client_outputs();
+    invalidate_plans();
+    toplevel_schedule();
+    idle_schedule();
+    update_output_manager();
+}
+
+void output_manager_apply_notify(struct wl_listener *listener, void *data) {
+    apply_output_config(data, false);
+}
+
+void output_manager_test_notify(struct wl_listener *listener, void *data) {
+    apply_output_config(data, true);
+}
+
+// Stops the compositor once the current dispatch is done
+void quit() {
+    wl_display_terminate(display);
+}
+
+static void find_headless(struct wlr_backend *b, void *data) {
+    if (wlr_backend_is_headless(b)) *(struct wlr_backend **) data = b;
+}
+
+// Headless backend outputs can be added to at runtime, NULL if wlc is not
+// running on one
+struct wlr_backend *headless_backend() {
+    if (wlr_backend_is_headless(backend)) return backend;
+    struct wlr_backend *headless = NULL;
+    if (wlr_backend_is_multi(backend)) wlr_multi_for_each_backend(backend, find_headless, &headless);
+    return headless;
 }
 
 // Event raised when cursor provides server with cursor image
@@ -748,13 +2412,41 @@ void seat_request_cursor(struct wl_listener *listener, void *data) {
                 event->surface, 
                 event->hotspot_x,
                 event->hotspot_y);
+        cursor_image = NULL;
     }
 }
 
+// Shows image name of the cursor theme. The theme is loaded for the scale of
+// each output in use the first time an image is needed after outputs changed,
+// and nothing is done while name is already shown
+void set_cursor_image(const char *name) {
+    if (cursor_scales_changed) {
+        cursor_scales_changed = false;
+        struct wlc_output *o;
+        wl_list_for_each(o, &outputs, link) {
+            // Outputs powered down while idle need the theme once input
+            // powers them up
+            if (!o->wlr_output->enabled && !o->powered_off) continue;
+            if (!wlr_xcursor_manager_load(cursor_mgr, o->wlr_output->scale)) {
+                ERROR("Could not load cursor theme at scale %.2f", o->wlr_output->scale);
+            }
+        }
+        // Outputs at a newly loaded scale do not have the current image yet
+        cursor_image = NULL;
+    }
+
+    if (cursor_image && !strcmp(cursor_image, name)) return;
+    cursor_image = name;
+    wlr_xcursor_manager_set_cursor_image(cursor_mgr, name, csr);
+}
+
 bool process_keybindings(xkb_keysym_t sym) {
+    // Without an output only the bindings that do not act on one work
+    if (!foutput && sym != XKB_KEY_Escape && sym != XKB_KEY_Return) return false;
+
     switch (sym) {
     case XKB_KEY_Escape:
-        wl_display_terminate(display);
+        quit();
         break;
     case XKB_KEY_1:
         toggle_tag(1);
@@ -770,15 +2462,28 @@ bool process_keybindings(xkb_keysym_t sym) {
         break;
     case XKB_KEY_t:
         foutput->layout = 0;
-        layouts[foutput->layout].l();
+        schedule_arrange(foutput);
         break;
     case XKB_KEY_m:
         foutput->layout = 1;
-        layouts[foutput->layout].l();
+        schedule_arrange(foutput);
+        break;
+    case XKB_KEY_f:
+        foutput->layout = 2;
+        break;
+    case XKB_KEY_Return:
+        spawn(termcmd);
+        break;
+    case XKB_KEY_F12:
+        hud_enabled = !hud_enabled;
+        struct wlc_output *o;
+        wl_list_for_each(o, &outputs, link) {
+            wlr_output_damage_add_whole(o->wlr_damage);
+        }
         break;
     case XKB_KEY_s:
         swap_master();
-        layouts[foutput->layout].l();
+        schedule_arrange(foutput);
         break;
     default:
         return false;
@@ -797,6 +2502,8 @@ void keyboard_modifiers_notify(struct wl_listener *listener, void *data) {
 void keyboard_key_notify(struct wl_listener *listener, void *data) {
     struct wlc_keyboard *kb = wl_container_of(listener, kb, key);
     struct wlr_event_keyboard_key *event = data;
+    record_event(WLC_INPUT_KEY, event);
+    idle_activity();
 
     // Get the keycode and convert to keysym
     uint32_t keycode = event->keycode + 8;
@@ -917,11 +2624,15 @@ bool setup() {
     renderer = wlr_backend_get_renderer(backend);
     wlr_renderer_init_wl_display(renderer, display);
 
-    wlr_compositor_create(display, renderer); // Create wayland compositor
+    compositor = wlr_compositor_create(display, renderer); // Create wayland compositor
+    listen(&new_surface, new_surface_notify, &compositor->events.new_surface);
 
     // Set up wayland outputs
     output_layout = wlr_output_layout_create();
+    // Position, mode, scale and transform changes of any output
+    listen(&layout_change, layout_change_notify, &output_layout->events.change);
     wl_list_init(&outputs);
+    wl_list_init(&mirrors);
     // new_output.notify = new_output_notify;
     // wl_signal_add(&backend->events.new_output, &new_output);
     listen(&new_output, new_output_notify, &backend->events.new_output);
@@ -937,14 +2648,38 @@ bool setup() {
     // wl_signal_add(&xdg_shell->events.new_surface, &new_xdg_surface);
     listen(&new_xdg_surface, new_xdg_surface_notify, &xdg_shell->events.new_surface);
 
-    wlr_xdg_decoration_manager_v1_create(display);
+    // Borders are drawn by wlc, so clients are asked not to draw titlebars
+    // and shadows of their own
+    decoration_manager = wlr_xdg_decoration_manager_v1_create(display);
+    listen(&new_decoration, new_decoration_notify, &decoration_manager->events.new_toplevel_decoration);
+
+    // Screen capture. Frames are read back from the buffer committed by
+    // output_frame_notify, and copy_with_damage reports the damage passed to
+    // wlr_output_set_damage there, so capture never causes a second render.
+    // Capture tools need xdg-output to find output positions
+    wlr_screencopy_manager_v1_create(display);
+    wlr_xdg_output_manager_v1_create(display, output_layout);
+
+    // Lets tools such as wlr-randr change mode, scale, position and enable
+    // state. Changes are tested before they are committed
+    output_manager = wlr_output_manager_v1_create(display);
+    listen(&output_manager_apply, output_manager_apply_notify, &output_manager->events.apply);
+    listen(&output_manager_test, output_manager_test_notify, &output_manager->events.test);
+
+    // Lets panels and window switchers list and activate clients
+    if (!toplevel_init(display)) ERROR("Failed to set up foreign toplevel management");
+
+    // Lets clients crop and scale their buffers, so at fractional output
+    // scales they can render at the exact size instead of oversampling
+    wlr_viewporter_create(display);
 
     // Set up cursor
     csr = wlr_cursor_create();
     wlr_cursor_attach_output_layout(csr, output_layout);
 
+    // Themes are only loaded once an image is shown, for the output scales in
+    // use then. See set_cursor_image
     cursor_mgr = wlr_xcursor_manager_create(NULL, 24);
-    wlr_xcursor_manager_load(cursor_mgr, 1);
 
     // cursor_motion.notify = cursor_motion_notify;
     // wl_signal_add(&csr->events.motion, &cursor_motion);
@@ -972,6 +2707,29 @@ bool setup() {
     // wl_signal_add(&seat->events.request_set_cursor, &request_cursor);
     listen(&request_cursor, seat_request_cursor, &seat->events.request_set_cursor);
 
+    // Idle notification and inhibition, and output power-down after
+    // idle_timeout seconds without input
+    if (!idle_init(display, seat, idle_timeout * 1000)) ERROR("Failed to set up idle protocols");
+
+    // Raw pointer motion and pointer lock/confine for games and 3D tools
+    relative_pointer_manager = wlr_relative_pointer_manager_v1_create(display);
+    pointer_constraints = wlr_pointer_constraints_v1_create(display);
+    listen(&new_constraint, new_constraint_notify, &pointer_constraints->events.new_constraint);
+
+#ifdef XWAYLAND
+    // Lazy Xwayland. The X socket exists right away but the server is only
+    // spawned when the first X11 client connects
+    xwayland = wlr_xwayland_create(display, compositor, true);
+    if (xwayland) {
+        listen(&new_xwayland_surface, new_xwayland_surface_notify, &xwayland->events.new_surface);
+        listen(&xwayland_ready, xwayland_ready_notify, &xwayland->events.ready);
+        setenv("DISPLAY", xwayland->display_name, true);
+    } else {
+        ERROR("Failed to set up Xwayland, X11 clients will not work");
+        unsetenv("DISPLAY");
+    }
+#endif
+
     return true;
 }
 
@@ -992,23 +2750,116 @@ bool run() {
         return false;
     }
     foutput = cursor_to_output(csr->x, csr->y);
+    INFO("Started in %.1f ms using %ld KiB", ms_since(&start_time), rss_kib(getpid()));
 
     // Set environment variable WAYLAND_DISPALY
     setenv("WAYLAND_DISPLAY", socket, true);
     INFO("Running Wayland compositor on WAYLAND_DISPLAY=%s", socket);
 
+    // Control socket for scripts. See ipc.c for the protocol
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char path[108];
+    snprintf(path, sizeof(path), "%s/wlc-%s.sock", runtime ? runtime : "/tmp", socket);
+    if (ipc_init(wl_display_get_event_loop(display), path)) {
+        setenv("WLC_SOCK", path, true);
+        launcher_setenv("WLC_SOCK", path);
+    }
+
+    // The launcher was forked before any of these were known
+    launcher_attach(wl_display_get_event_loop(display));
+    launcher_setenv("WAYLAND_DISPLAY", socket);
+#ifdef XWAYLAND
+    if (xwayland) launcher_setenv("DISPLAY", xwayland->display_name);
+#endif
+    if (startup_cmd) spawn((const char *[]) { "/bin/sh", "-c", startup_cmd, NULL });
+    replay_start(wl_display_get_event_loop(display));
+
     // Run wayland display
     wl_display_run(display);
     return true;
 }
 
 void cleanup() {
+    hud_finish();
+    toplevel_finish();
+    idle_finish();
+#ifdef XWAYLAND
+    if (xwayland) {
+        wlr_xwayland_destroy(xwayland);
+        xwayland = NULL;
+    }
+#endif
+    if (arrange_source) {
+        wl_event_source_remove(arrange_source);
+        arrange_source = NULL;
+    }
+    ipc_finish();
+    dump_finish();
+    replay_finish();
+    launcher_finish();
     wl_display_destroy_clients(display);
     wl_display_destroy(display);
 }
 
 int main(int argc, char *argv[]) {
     wlr_log_init(WLR_DEBUG, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    // Fork the launcher while wlc is still small. Bindings can't spawn
+    // programs without it, but everything else works
+    launcher_init();
+
+    // -d dir dumps composited frames of a headless session into dir, -n n
+    // only dumps every nth frame. -x cmd runs cmd with the compositor's
+    // environment once it is up. -r file records input events to file, -p file
+    // replays them headless at speed -s, 0 for as fast as possible
+    const char *dump_dir = NULL;
+    uint32_t dump_every = 1;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    double_t replay_speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:x:r:p:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            dump_dir = optarg;
+            break;
+        case 'n':
+            dump_every = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            startup_cmd = optarg;
+            break;
+        case 'r':
+            record_path = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 's':
+            replay_speed = strtod(optarg, NULL);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d dir [-n n]] [-x cmd] [-r file] [-p file [-s speed]]\n", 
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (dump_dir) {
+        setenv("WLR_BACKENDS", "headless", true);
+        setenv("WLR_HEADLESS_OUTPUTS", "1", false);
+        setenv("WLR_LIBINPUT_NO_DEVICES", "1", false);
+        if (!dump_init(dump_dir, dump_every)) return 1;
+    }
+
+    if (replay_path) {
+        setenv("WLR_BACKENDS", "headless", true);
+        setenv("WLR_HEADLESS_OUTPUTS", "1", false);
+        setenv("WLR_LIBINPUT_NO_DEVICES", "1", false);
+        if (!replay_init(replay_path, replay_speed)) return 1;
+    }
+    if (record_path && !record_init(record_path)) return 1;
+
     if (!setup()) {
         ERROR("Failure to create server");
         cleanup();
@@ -4,8 +4,12 @@
 #include <wayland-util.h>
 #include <wlr/render/wlr_renderer.h>
 
+#include <wlr/types/wlr_foreign_toplevel_management_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <xkbcommon/xkbcommon.h>
+#ifdef XWAYLAND
+#include <wlr/xwayland.h>
+#endif
 
 // #define VISIBLE(c, o) (c->output == o && c->tag & o->tag)
 #include <wlr/util/log.h>
@@ -15,12 +19,45 @@
 #define INFO(...) wlr_log(WLR_INFO, __VA_ARGS__)
 #define ERROR(...) wlr_log(WLR_ERROR, __VA_ARGS__)
 
+// Number of arrange results memoized per output
+#define LAYOUT_CACHE_SIZE 8
+// Frames kept for the performance overlay
+#define HUD_SAMPLES 64
+
 enum wlc_cursor_mode {
     WLC_CURSOR_RESIZE,
     WLC_CURSOR_MOVE,
     WLC_CURSOR_NORMAL,
 };
 
+// Slot boxes produced by a layout for one set of inputs. Entries with used == 0
+// are empty
+struct wlc_layout_cache_entry {
+    uint32_t layout;
+    int width;
+    int height;
+    uint32_t n_master;
+    double_t f_master;
+    uint32_t nc;
+    uint64_t used;
+    struct wlr_box *slots;
+};
+
+// One surface to draw, in output buffer coordinates
+struct wlc_plan_entry {
+    struct wlr_surface *surface;
+    struct wlc_client *client;
+    struct wlr_box box;
+    float matrix[9];
+};
+
+// Visible part of a client's border, in output buffer coordinates. The colour
+// is picked from the client's focus when it is drawn
+struct wlc_border_rect {
+    struct wlr_box box;
+    struct wlc_client *client;
+};
+
 struct wlc_output {
     struct wlr_output *wlr_output;
     struct timespec last_frame;
@@ -33,23 +70,121 @@ struct wlc_output {
     struct wlr_box *geom;
     uint16_t tag;
     struct wlr_output_damage *wlr_damage;
-    struct wl_listener commit;
+    struct wlc_layout_cache_entry cache[LAYOUT_CACHE_SIZE];
+    uint64_t cache_tick;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    bool dirty; // Needs an arrange and a full repaint
+    bool needs_arrange;
+    uint64_t arrange_requests;
+    uint64_t arranges; // arrange_requests - arranges were coalesced
+    uint64_t frames; // Frames rendered
+    uint64_t rendered_px; // Pixels drawn for clients in the last frame
+    uint32_t bit; // Identifies the output in wlc_client.outputs, 0 past 32 outputs
+    uint32_t composited; // Clients drawn in the last frame
+    uint64_t damage_px; // Damage of the last frame without the overlay
+    uint64_t arrange_ns; // Duration of the last arrange
+    uint64_t hud_render_ns[HUD_SAMPLES];
+    uint64_t hud_frame_ns[HUD_SAMPLES];
+    uint32_t hud_sample;
+    bool hud_shown; // Overlay was drawn in the last frame
+    const char *mirror_of; // Name of the mirrored output, NULL if not a mirror
+    bool mirror_dirty; // Source showed a new frame since the last copy
+    uint64_t mirror_frames; // Frames copied from the source
+    struct wlr_box disabled_geom; // geom while the output is out of the layout
+    struct wlc_plan_entry *plan; // Surfaces to draw, back to front
+    uint32_t plan_len;
+    uint32_t plan_cap;
+    uint64_t plan_serial; // Serial the plan was built for
+    uint64_t plan_builds;
+    struct wlc_border_rect *borders; // Built with the plan, drawn after it
+    uint32_t borders_len;
+    uint32_t borders_cap;
+    bool powered_off; // Disabled while idle, enabled again by input
+};
+
+// Per client load accounting, collected from the commit path
+struct wlc_client_stats {
+    uint64_t commits;
+    uint64_t dropped; // Commits replaced by a newer one before being presented
+    uint64_t frames; // Frames in which a new commit of the client was presented
+    uint64_t damage_px; // Surface local damage committed
+    uint32_t pending; // Commits since the last presentation
+    int buffer_width;
+    int buffer_height;
+};
+
+// Input events that can be recorded and replayed, see replay.c
+enum wlc_input_type {
+    WLC_INPUT_KEY,
+    WLC_INPUT_MOTION,
+    WLC_INPUT_MOTION_ABSOLUTE,
+    WLC_INPUT_BUTTON,
+    WLC_INPUT_AXIS,
+    WLC_INPUT_FRAME,
+    WLC_INPUT_TYPES,
+};
+
+enum wlc_client_type {
+    WLC_XDG,
+    WLC_X11,
 };
 
 struct wlc_client {
     // struct wlc_server* server;
-    struct wlr_xdg_surface *xdg_surface;
+    uint32_t id;
+    enum wlc_client_type type;
+    union {
+        struct wlr_xdg_surface *xdg_surface;
+#ifdef XWAYLAND
+        struct wlr_xwayland_surface *xsurface;
+#endif
+    };
+    bool unmanaged; // Override redirect X11 window. Only stacked, never tiled
     struct wlc_output *output;
     struct wlr_box geom;
     struct wl_listener map;
     struct wl_listener unmap;
     struct wl_listener destroy;
-    // struct wl_listener request_move;
-    // struct wl_listener request_resize;
+    struct wl_listener commit;
+    struct wl_listener request_move;
+    struct wl_listener request_resize;
+    struct wl_listener set_title;
+    struct wl_listener set_app_id; // Window class for X11 windows
+#ifdef XWAYLAND
+    struct wl_listener request_configure;
+#endif
     struct wl_list llink;
     struct wl_list flink;
     struct wl_list zlink;
     uint8_t tag;
+    // Size of the last committed buffer. geom holds the configured size
+    int cw;
+    int ch;
+    uint32_t outputs; // Outputs the client has entered, by wlc_output.bit
+    struct wlc_client_stats stats;
+    uint64_t plan_sig; // Surface positions of the last commit, see surface_sig
+    struct wlr_foreign_toplevel_handle_v1 *toplevel; // While mapped and managed
+    struct wl_listener toplevel_activate;
+    struct wl_listener toplevel_close;
+    char *ft_title; // Last state published on the toplevel handle
+    char *ft_app_id;
+    bool ft_activated;
+    bool ft_minimized;
+    struct wlr_output *ft_output;
+    // Interactive resize throttling. A new size is only configured once the
+    // client has acked and committed resize_serial
+    uint32_t resize_serial;
+    bool resize_pending;
+    int pw;
+    int ph;
+    // Edges dragged by the last interactive resize and the geometry when it
+    // started. The opposite edges stay in place until its last size is acked
+    uint32_t anchor_edges;
+    struct wlr_box anchor;
+    struct wl_list children; // wlc_child.link
+    struct wl_listener new_subsurface;
+    struct wl_listener new_popup;
 };
 
 struct render_data {
@@ -59,6 +194,39 @@ struct render_data {
     struct timespec *when;
 };
 
+// Pointer lock or confinement requested by a client
+struct wlc_constraint {
+    struct wlr_pointer_constraint_v1 *constraint;
+    struct wl_listener destroy;
+};
+
+struct wlc_surface_watch {
+    struct wl_listener commit;
+    struct wl_listener destroy;
+    int width;
+    int height;
+    enum wl_output_transform transform;
+};
+
+// Subsurface or popup of a client. Commits of its own damage the client's
+// output at the child's offset
+struct wlc_child {
+    struct wl_list link;
+    struct wlc_client *client;
+    struct wlr_surface *surface;
+    bool popup;
+    bool mapped;
+    uint32_t outputs; // Outputs the child has entered, by wlc_output.bit
+    struct wlr_box box; // Drawn position relative to the client, empty while unmapped
+    struct wl_listener commit;
+    struct wl_listener map;
+    struct wl_listener unmap;
+    struct wl_listener destroy;
+    struct wl_listener new_subsurface;
+    struct wl_listener new_popup; // Popups only
+    struct wl_listener reposition; // Popups only
+};
+
 struct wlc_keyboard {
     struct wl_list link;
     struct wlr_input_device *device;
@@ -67,8 +235,23 @@ struct wlc_keyboard {
     struct wl_listener destroy;
 };
 
+struct wlc_output_rule {
+    const char *name;
+    float scale;
+    int32_t width; // Custom mode for outputs without modes, 0 to keep the default
+    int32_t height;
+    int32_t refresh; // mHz
+};
+
+struct wlc_mirror_rule {
+    const char *name;
+    const char *source;
+};
+
+// Fills slots with the boxes of nc visible clients on an output, in lstack
+// order. Boxes are in output local coordinates
 struct wlc_layout {
-    void (*l)();
+    void (*l)(struct wlc_output *o, uint32_t nc, struct wlr_box *slots);
     const char *s;
 };
 
@@ -77,7 +260,67 @@ void resize(struct wlc_client *c, double_t w, double_t h);
 void move(struct wlc_client *c, uint32_t x, uint32_t y);
 struct wlc_client* fstack_top();
 uint8_t visible(struct wlc_client *c, struct wlc_output *o);
+void arrange(struct wlc_output *o);
+void schedule_arrange(struct wlc_output *o);
+void update_client_outputs(struct wlc_client *c);
+void update_all_client_outputs();
+void invalidate_plans();
+void focus_client(struct wlc_client *c, struct wlr_surface *surface);
+struct wlr_surface *client_surface(struct wlc_client *c);
+const char *client_title(struct wlc_client *c);
+const char *client_app_id(struct wlc_client *c);
+void client_close(struct wlc_client *c);
+struct wlr_surface *focused_surface();
+bool surface_shown(struct wlr_surface *s);
+struct wlc_layout *get_layout(uint32_t i);
+struct wlr_backend *headless_backend();
+void quit();
+
+bool ipc_init(struct wl_event_loop *loop, const char *path);
+void ipc_finish();
+
+bool dump_init(const char *dir, uint32_t every);
+bool dump_enabled();
+void dump_frame(struct wlc_output *o, struct wlr_renderer *r, uint64_t render_ns);
+void dump_finish();
+uint64_t region_area(pixman_region32_t *region);
+
+extern bool hud_enabled;
+void hud_box(struct wlr_box *box);
+void hud_record(struct wlc_output *o, uint64_t render_ns);
+void hud_render(struct wlc_output *o, struct wlr_renderer *r);
+void hud_finish();
+
+void mirror_damage(struct wlc_output *src);
+void mirror_frame_notify(struct wl_listener *listener, void *data);
+
+bool toplevel_init(struct wl_display *display);
+void toplevel_schedule();
+void toplevel_create(struct wlc_client *c);
+void toplevel_destroy(struct wlc_client *c);
+void toplevel_output_destroyed(struct wlc_output *o);
+void toplevel_finish();
+
+bool idle_init(struct wl_display *display, struct wlr_seat *seat, uint32_t timeout);
+void idle_activity();
+void idle_schedule();
+void idle_finish();
+
+bool record_init(const char *path);
+void record_event(enum wlc_input_type type, const void *event);
+bool replay_init(const char *path, double_t speed);
+void replay_start(struct wl_event_loop *loop);
+void replay_finish();
+
+bool launcher_init();
+void launcher_attach(struct wl_event_loop *loop);
+void launcher_setenv(const char *name, const char *value);
+void spawn(const char **argv);
+void launcher_finish();
 
 extern struct wlc_output *foutput;
 extern struct wl_list lstack; // Client layout configuration (size and positioning)
+extern struct wl_list fstack; // Client focusing
+extern struct wl_list outputs;
+extern struct wl_list mirrors; // Mirror outputs, not part of outputs
 #endif // !BASE_H